@@ -0,0 +1,201 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// for asprintf and clock_gettime
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "mux.h"
+
+// a "*" broadcast over the whole registry: walking mux_client_tree and
+// sending through each client record, as a sweep had to before the slots,
+// against the pass over the dense slot array that mux_broadcast() makes.
+// sends only touch the stream, so what is left is the cost of reaching it
+#define CLIENTS_SMALL 100000
+#define CLIENTS_LARGE 1000000
+#define ROUNDS 10
+
+static int client_cmp(struct mux_client *e1, struct mux_client *e2)
+{
+    return strcmp(e1->tag, e2->tag);
+}
+
+RB_HEAD(client_tree, mux_client);
+RB_GENERATE(client_tree, mux_client, entry, client_cmp);
+
+static size_t sent;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// stands in for sev_send(), which starts at the stream
+__attribute__((noinline))
+static void bench_send(struct sev_stream *stream, const char *data,
+    size_t len)
+{
+    sent += len + (stream->data != NULL);
+}
+
+static void server_message(struct mux_client *client, char *message,
+    size_t len)
+{
+    // mux_send()
+    if (client->tls)
+        return;
+
+    bench_send(client->stream, message, len);
+}
+
+static void server_broadcast(struct sev_stream *stream, int flags,
+    char *message, size_t len)
+{
+    bench_send(stream, message, len);
+}
+
+static const struct mux_protocol protocol = {
+    .name = "tcpmux",
+    .server_message = server_message,
+    .server_broadcast = server_broadcast,
+};
+
+static struct mux_listener listener = { .protocol = &protocol };
+
+// the tree walk mux_deliver() would make for every client
+static void broadcast_tree(struct client_tree *head, char *message,
+    size_t len)
+{
+    struct mux_client *client;
+
+    RB_FOREACH(client, client_tree, head) {
+        if (client->state == MUX_DETACHED)
+            continue;
+
+        client->listener->protocol->server_message(client, message, len);
+    }
+}
+
+// mux_broadcast()'s loop, for clients that are neither detached nor tls
+static void broadcast_slots(struct mux_slot *slots, size_t count,
+    char *message, size_t len)
+{
+    for (size_t i = count; i-- > 0; ) {
+        struct mux_slot *slot = &slots[i];
+
+        if (slot->flags & (MUX_FLAG_DETACHED | MUX_FLAG_TLS)) {
+            slot->listener->protocol->server_message(slot->client, message,
+                len);
+            continue;
+        }
+
+        slot->listener->protocol->server_broadcast(slot->stream,
+            slot->flags, message, len);
+    }
+}
+
+static void bench(size_t count, int rounds)
+{
+    struct client_tree head = RB_INITIALIZER(&head);
+    struct mux_slot *slots = malloc(count * sizeof(struct mux_slot));
+
+    // clients arrive from random addresses, so the tree's tag order is
+    // unrelated to the order they were allocated in, as in the mux
+    for (size_t i = 0; i < count; i++) {
+        struct sev_stream *stream = calloc(1, sizeof(struct sev_stream));
+        struct mux_client *client = calloc(1, sizeof(struct mux_client));
+
+        asprintf(&client->tag, "tcpmux:10.%d.%d.%d-%d", rand() % 256,
+            rand() % 256, rand() % 256, 1024 + rand() % 60000);
+        client->listener = &listener;
+        client->stream = stream;
+        client->state = MUX_ACTIVE;
+        client->attached = 1;
+        stream->data = client;
+
+        if (RB_INSERT(client_tree, &head, client)) {
+            free(client->tag);
+            free(client);
+            free(stream);
+            i--;
+            continue;
+        }
+
+        client->slot = i;
+        slots[i] = (struct mux_slot) {
+            .stream = stream,
+            .listener = &listener,
+            .client = client,
+        };
+    }
+
+    char message[] = ":server NOTICE * :maintenance in 5 minutes\r\n";
+    size_t len = sizeof(message) - 1;
+
+    double tree = 0, dense = 0;
+
+    for (int r = 0; r < rounds; r++) {
+        double start = now();
+        broadcast_tree(&head, message, len);
+        tree += now() - start;
+
+        start = now();
+        broadcast_slots(slots, count, message, len);
+        dense += now() - start;
+    }
+
+    tree /= rounds;
+    dense /= rounds;
+
+    printf("%7zu clients: tree %.2fms (%.1fns/client) slots %.2fms "
+        "(%.1fns/client) (%.1fx)\n", count, tree * 1e3, tree * 1e9 / count,
+        dense * 1e3, dense * 1e9 / count, tree / dense);
+
+    for (size_t i = 0; i < count; i++) {
+        free(slots[i].client->tag);
+        free(slots[i].client);
+        free(slots[i].stream);
+    }
+    free(slots);
+}
+
+// usage: broadcastbench [clients ...]
+int main(int argc, char *argv[])
+{
+    if (argc == 1) {
+        bench(CLIENTS_SMALL, ROUNDS);
+        bench(CLIENTS_LARGE, ROUNDS);
+    }
+
+    for (int i = 1; i < argc; i++)
+        bench(atol(argv[i]), ROUNDS);
+
+    // every client is sent every broadcast
+    return sent == 0;
+}
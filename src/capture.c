@@ -0,0 +1,142 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// for ftruncate
+#define _GNU_SOURCE 1
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "capture.h"
+
+#define CAPTURE_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+int capture_open(struct capture *capture, const char *path)
+{
+    *capture = (struct capture) { .fd = -1 };
+
+    capture->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (capture->fd == -1)
+        return -1;
+
+    // sparse; the tail of zeroes marks the end
+    if (ftruncate(capture->fd, CAPTURE_FILE_SIZE) == -1)
+        goto fail;
+
+    capture->file = mmap(NULL, CAPTURE_FILE_SIZE, PROT_READ | PROT_WRITE,
+        MAP_SHARED, capture->fd, 0);
+    if (capture->file == MAP_FAILED)
+        goto fail;
+
+    capture->size = CAPTURE_FILE_SIZE;
+    memcpy(capture->file, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+    capture->head = CAPTURE_ALIGN(sizeof(CAPTURE_MAGIC));
+
+    return 0;
+
+fail:
+    close(capture->fd);
+    *capture = (struct capture) { .fd = -1 };
+    return -1;
+}
+
+int capture_write(struct capture *capture, double time, int type,
+    uint32_t stream, int port, const char *data, size_t len)
+{
+    size_t need = sizeof(struct capture_record) + CAPTURE_ALIGN(len);
+
+    // leave room for the zero record that ends the capture
+    if (capture->file == NULL ||
+            capture->head + need + sizeof(struct capture_record) >
+            capture->size)
+        return -1;
+
+    struct capture_record *record =
+        (struct capture_record *)(capture->file + capture->head);
+
+    memcpy(record + 1, data, len);
+    record->stream = stream;
+    record->type = type;
+    record->port = port;
+    record->len = len;
+    record->time = time;
+
+    capture->head += need;
+
+    return 0;
+}
+
+int capture_map(struct capture *capture, const char *path)
+{
+    *capture = (struct capture) { .fd = -1 };
+
+    capture->fd = open(path, O_RDONLY);
+    if (capture->fd == -1)
+        return -1;
+
+    struct stat st;
+    if (fstat(capture->fd, &st) == -1 || st.st_size < sizeof(CAPTURE_MAGIC))
+        goto fail;
+
+    capture->file = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+        capture->fd, 0);
+    if (capture->file == MAP_FAILED)
+        goto fail;
+
+    capture->size = st.st_size;
+    capture->head = CAPTURE_ALIGN(sizeof(CAPTURE_MAGIC));
+
+    if (memcmp(capture->file, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)))
+        goto fail;
+
+    return 0;
+
+fail:
+    close(capture->fd);
+    *capture = (struct capture) { .fd = -1 };
+    return -1;
+}
+
+struct capture_record *capture_next(struct capture *capture, size_t *pos)
+{
+    if (*pos < capture->head)
+        *pos = capture->head;
+
+    if (*pos + sizeof(struct capture_record) > capture->size)
+        return NULL;
+
+    struct capture_record *record =
+        (struct capture_record *)(capture->file + *pos);
+
+    if (record->time == 0 || *pos + sizeof(struct capture_record) +
+            record->len > capture->size)
+        return NULL;
+
+    *pos += sizeof(struct capture_record) + CAPTURE_ALIGN(record->len);
+
+    return record;
+}
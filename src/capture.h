@@ -0,0 +1,67 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+// append-only, memory-mapped record of a mux's traffic
+#define CAPTURE_FILE_SIZE (1ULL << 30)
+#define CAPTURE_MAGIC "muxcap1"
+
+enum capture_type {
+    CAPTURE_OPEN,       // data is the client tag, port the listener's
+    CAPTURE_READ,       // data is the raw bytes read from the socket
+    CAPTURE_CLOSE,
+    CAPTURE_EGRESS,     // data is the reply popped, port the lane
+};
+
+// followed by len bytes of data, padded to 8 bytes; a record with a zero
+// time ends the capture
+struct capture_record {
+    double time;
+    uint32_t stream;
+    uint16_t type;
+    uint16_t port;
+    uint32_t len;
+};
+
+struct capture {
+    int fd;
+    char *file;
+    size_t size;
+    size_t head;
+};
+
+int capture_open(struct capture *capture, const char *path);
+
+// returns -1 once the file is full
+int capture_write(struct capture *capture, double time, int type,
+    uint32_t stream, int port, const char *data, size_t len);
+
+// map an existing capture read-only, for replay
+int capture_map(struct capture *capture, const char *path);
+
+// the record at *pos, advancing *pos past it, or NULL at the end
+struct capture_record *capture_next(struct capture *capture, size_t *pos);
@@ -0,0 +1,154 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// for asprintf
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "../hiredis/adapters/libev.h"
+#include "queue.h"
+#include "inbound.h"
+
+static void inbound_connect(struct inbound *inbound);
+
+static void inbound_cb(redisAsyncContext *redis, void *r, void *privdata);
+
+static void inbound_pop(struct inbound *inbound)
+{
+    int normal = ++inbound->pops % INBOUND_WEIGHT == 0;
+
+    // BLPOP takes from the first non-empty list in the order given
+    redisAsyncCommand(inbound->redis, inbound_cb, NULL, "BLPOP %s %s 0",
+        inbound->keys[normal ? LANE_NORMAL : LANE_HIGH],
+        inbound->keys[normal ? LANE_HIGH : LANE_NORMAL]);
+}
+
+static void inbound_cb(redisAsyncContext *redis, void *r, void *privdata)
+{
+    struct inbound *inbound = redis->data;
+    redisReply *reply = r;
+
+    // disconnected; the pop is issued again on reconnect
+    if (reply == NULL)
+        return;
+
+    if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 2) {
+        int lane = strcmp(reply->element[0]->str,
+            inbound->keys[LANE_HIGH]) ? LANE_NORMAL : LANE_HIGH;
+
+        inbound->popped[lane]++;
+        inbound->cb(lane, reply->element[1]->str, reply->element[1]->len);
+    }
+
+    inbound_pop(inbound);
+}
+
+static void inbound_connect_cb(const redisAsyncContext *redis, int status)
+{
+    struct inbound *inbound = redis->data;
+
+    if (status != REDIS_OK) {
+        printf("redis %s:%d connect error: %s\n", inbound->host,
+            inbound->port, redis->errstr);
+        inbound->redis = NULL;
+        ev_timer_start(EV_DEFAULT_ &inbound->reconnect);
+        return;
+    }
+
+    inbound_pop(inbound);
+}
+
+static void inbound_disconnect_cb(const redisAsyncContext *redis, int status)
+{
+    struct inbound *inbound = redis->data;
+
+    printf("redis %s:%d disconnected\n", inbound->host, inbound->port);
+    inbound->redis = NULL;
+    ev_timer_start(EV_DEFAULT_ &inbound->reconnect);
+}
+
+static void inbound_reconnect_cb(EV_P_ ev_timer *watcher, int revents)
+{
+    struct inbound *inbound = watcher->data;
+
+    ev_timer_stop(EV_A_ watcher);
+    inbound_connect(inbound);
+}
+
+static void inbound_connect(struct inbound *inbound)
+{
+    redisAsyncContext *redis = redisAsyncConnect(inbound->host,
+        inbound->port);
+
+    if (redis->err) {
+        printf("redis %s:%d error: %s\n", inbound->host, inbound->port,
+            redis->errstr);
+        redisAsyncFree(redis);
+        ev_timer_start(EV_DEFAULT_ &inbound->reconnect);
+        return;
+    }
+
+    redis->data = inbound;
+    inbound->redis = redis;
+    inbound_busy_poll(inbound, inbound->busy_poll);
+
+    redisLibevAttach(EV_DEFAULT_ redis);
+    redisAsyncSetConnectCallback(redis, inbound_connect_cb);
+    redisAsyncSetDisconnectCallback(redis, inbound_disconnect_cb);
+    redisAsyncCommand(redis, NULL, NULL, "SELECT %d", inbound->db);
+}
+
+void inbound_init(struct inbound *inbound, const char *host, int port,
+    int db, const char *key, void (*cb)(int lane, char *message,
+        size_t len))
+{
+    *inbound = (struct inbound) {
+        .host = strdup(host),
+        .port = port,
+        .db = db,
+        .cb = cb,
+    };
+
+    inbound->keys[LANE_NORMAL] = strdup(key);
+    asprintf(&inbound->keys[LANE_HIGH], "%s:high", key);
+
+    ev_timer_init(&inbound->reconnect, inbound_reconnect_cb, QUEUE_RECONNECT,
+        0);
+    inbound->reconnect.data = inbound;
+
+    inbound_connect(inbound);
+}
+
+void inbound_busy_poll(struct inbound *inbound, int usecs)
+{
+    inbound->busy_poll = usecs;
+
+    if (usecs && inbound->redis && setsockopt(inbound->redis->c.fd,
+            SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == -1)
+        perror("SO_BUSY_POLL");
+}
@@ -0,0 +1,54 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// lanes and the reconnect delay are shared with queue.h, which must be
+// included first
+
+// under contention the normal lane is popped first once every this many
+// pops, so the high lane drains first without starving it
+#define INBOUND_WEIGHT 8
+
+// blocking pop from a list and its ":high" companion, one at a time
+struct inbound {
+    char *host;
+    int port;
+    int db;
+    char *keys[LANES];
+
+    redisAsyncContext *redis;
+    int busy_poll;
+    ev_timer reconnect;
+    unsigned pops;
+
+    void (*cb)(int lane, char *message, size_t len);
+    uint64_t popped[LANES];
+};
+
+void inbound_init(struct inbound *inbound, const char *host, int port,
+    int db, const char *key, void (*cb)(int lane, char *message,
+        size_t len));
+
+// like queue_busy_poll()
+void inbound_busy_poll(struct inbound *inbound, int usecs);
@@ -0,0 +1,140 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "iptable.h"
+
+#define IPTABLE_MIN_SIZE 1024
+
+// ipv4 addresses are stored as v4-mapped ipv6 addresses
+static int iptable_key(const char *address, uint8_t *key)
+{
+    if (inet_pton(AF_INET6, address, key) == 1)
+        return 0;
+
+    memset(key, 0, 10);
+    key[10] = key[11] = 0xff;
+
+    if (inet_pton(AF_INET, address, key + 12) == 1)
+        return 0;
+
+    return -1;
+}
+
+static size_t iptable_hash(const uint8_t *key)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < 16; i++)
+        hash = (hash ^ key[i]) * 1099511628211ULL;
+
+    return hash;
+}
+
+// linear probing; returns the slot holding the key, or the empty slot
+// where it would go
+static struct ipcount *iptable_find(struct iptable *table, const uint8_t *key)
+{
+    size_t mask = table->size - 1;
+    size_t i = iptable_hash(key) & mask;
+
+    while (table->slots[i].count && memcmp(table->slots[i].addr, key, 16))
+        i = (i + 1) & mask;
+
+    return &table->slots[i];
+}
+
+static int iptable_grow(struct iptable *table)
+{
+    struct iptable grown = {
+        .size = table->size ? table->size * 2 : IPTABLE_MIN_SIZE,
+        .used = table->used,
+    };
+
+    grown.slots = calloc(grown.size, sizeof(struct ipcount));
+    if (!grown.slots)
+        return -1;
+
+    for (size_t i = 0; i < table->size; i++)
+        if (table->slots[i].count)
+            *iptable_find(&grown, table->slots[i].addr) = table->slots[i];
+
+    free(table->slots);
+    *table = grown;
+
+    return 0;
+}
+
+int iptable_add(struct iptable *table, const char *address, uint32_t limit)
+{
+    uint8_t key[16];
+    if (iptable_key(address, key) == -1)
+        return 0;
+
+    // keep the load factor under 1/2
+    if (table->used * 2 >= table->size && iptable_grow(table) == -1)
+        return -1;
+
+    struct ipcount *slot = iptable_find(table, key);
+
+    if (slot->count >= limit)
+        return -1;
+
+    if (slot->count++ == 0) {
+        memcpy(slot->addr, key, 16);
+        table->used++;
+    }
+
+    return 0;
+}
+
+void iptable_del(struct iptable *table, const char *address)
+{
+    uint8_t key[16];
+    if (table->size == 0 || iptable_key(address, key) == -1)
+        return;
+
+    struct ipcount *slot = iptable_find(table, key);
+    if (!slot->count || --slot->count)
+        return;
+
+    table->used--;
+
+    // backward-shift deletion, so lookups never need tombstones
+    size_t mask = table->size - 1;
+    size_t i = slot - table->slots;
+
+    for (size_t j = (i + 1) & mask; table->slots[j].count; j = (j + 1) & mask) {
+        size_t home = iptable_hash(table->slots[j].addr) & mask;
+
+        // move j into the hole unless its home lies cyclically in (i, j]
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            table->slots[i] = table->slots[j];
+            table->slots[j].count = 0;
+            i = j;
+        }
+    }
+}
@@ -0,0 +1,186 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// for getopt
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include "mux.h"
+#include "tls.h"
+
+extern const struct mux_protocol tcpmux_protocol;
+extern const struct mux_protocol ircmux_protocol;
+extern const struct mux_protocol wsmux_protocol;
+
+static const struct mux_protocol *protocols[] = {
+    &tcpmux_protocol,
+    &ircmux_protocol,
+    &wsmux_protocol,
+};
+
+#define PROTOCOLS (sizeof(protocols) / sizeof(protocols[0]))
+
+// listeners started when none are given on the command line
+static char *defaults[] = { "tcpmux", "wsmux" };
+
+static const struct mux_protocol *find_protocol(const char *name, size_t len)
+{
+    for (int i = 0; i < PROTOCOLS; i++)
+        if (strlen(protocols[i]->name) == len &&
+                !strncmp(protocols[i]->name, name, len))
+            return protocols[i];
+
+    return NULL;
+}
+
+// usage: mux [-c capture] [-a core] [-b usecs] [-u] [-r bytes] [-t cert]
+//            [-k key] [protocol[:port][:tls] ...]
+//
+// -u lifts the per-address cap and the rate limits and -r sets the read
+// budget (0 turns it off), for benchmarks over loopback
+int main(int argc, char *argv[])
+{
+    char *capture = NULL;
+    int core = -1;
+    int busy_poll = 0;
+    int unlimited = 0;
+    int budget = -1;
+    char *cert = NULL;
+    char *key = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:a:b:ur:t:k:")) != -1) {
+        switch (opt) {
+        case 'c':
+            capture = optarg;
+            break;
+
+        case 't':
+            cert = optarg;
+            break;
+
+        case 'k':
+            key = optarg;
+            break;
+
+        case 'a':
+            core = atoi(optarg);
+            break;
+
+        case 'b':
+            busy_poll = atoi(optarg);
+            break;
+
+        case 'u':
+            unlimited = 1;
+            break;
+
+        case 'r':
+            budget = atoi(optarg);
+            break;
+
+        default:
+            fprintf(stderr, "usage: %s [-c capture] [-a core] [-b usecs] "
+                "[-u] [-r bytes] [-t cert] [-k key] [protocol[:port][:tls] "
+                "...]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    char **specs = argv + optind;
+    int count = argc - optind;
+
+    if (count == 0) {
+        specs = defaults;
+        count = sizeof(defaults) / sizeof(defaults[0]);
+    }
+
+    for (int i = 0; i < PROTOCOLS; i++)
+        if (protocols[i]->init)
+            protocols[i]->init();
+
+    mux_init();
+
+    if ((core >= 0 || busy_poll > 0) && mux_busypoll(core, busy_poll) == -1) {
+        perror("sched_setaffinity");
+        return -1;
+    }
+
+    if (unlimited)
+        mux_unlimit();
+
+    if (budget >= 0)
+        mux_read_budget(budget);
+
+    if (capture && mux_capture(capture) == -1) {
+        perror("capture");
+        return -1;
+    }
+
+    // the key may be in the certificate's pem file
+    struct tls_server *tls = NULL;
+    if (cert && (tls = tls_server_new(cert, key ? key : cert)) == NULL) {
+        fprintf(stderr, "cannot load certificate %s\n", cert);
+        return -1;
+    }
+
+    struct mux_listener *listeners = calloc(count,
+        sizeof(struct mux_listener));
+
+    for (int i = 0; i < count; i++) {
+        char *port = strchr(specs[i], ':');
+        size_t len = port ? port - specs[i] : strlen(specs[i]);
+
+        char *suffix = strrchr(specs[i], ':');
+        int secure = suffix && !strcmp(suffix, ":tls");
+        if (port && !isdigit((unsigned char)port[1]))
+            port = NULL;
+
+        if (secure && tls == NULL) {
+            fprintf(stderr, "%s needs a certificate (-t)\n", specs[i]);
+            return -1;
+        }
+
+        const struct mux_protocol *protocol = find_protocol(specs[i], len);
+        if (protocol == NULL) {
+            fprintf(stderr, "unknown protocol %.*s\n", (int)len, specs[i]);
+            return -1;
+        }
+
+        if (mux_listen(&listeners[i], protocol,
+                port ? atoi(port + 1) : protocol->port,
+                secure ? tls : NULL)) {
+            perror("sev_server_init");
+            return -1;
+        }
+    }
+
+    sev_loop();
+
+    return 0;
+}
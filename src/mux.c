@@ -23,25 +23,159 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-// for asprintf
+// for asprintf and sched_setaffinity
 #define _GNU_SOURCE 1
 
 #include <stdio.h>
 #include <string.h>
-#include "../redismq/redismq.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include "queue.h"
+#include "inbound.h"
+#include "iptable.h"
+#include "trace.h"
+#include "profile.h"
+#include "capture.h"
+#include "tls.h"
 #include "mux.h"
 
-#define REDIS_HOST "127.0.0.1"
-#define REDIS_PORT 6379
+// every listener shares the registry and the redis queues under this name
+#define NAME "mux"
+
 #define REDIS_DB 7
 
-extern char *name;
-extern void server_message(struct mux_client *, char *message);
-extern void server_close(struct mux_client *);
-extern void process_message(char *message);
+// ingress is sharded across these by a consistent hash of the client tag,
+// and the inbound queue is popped from all of them
+static struct {
+    const char *host;
+    int port;
+} redis_shards[] = {
+    { "127.0.0.1", 6379 },
+};
+
+#define SHARDS (sizeof(redis_shards) / sizeof(redis_shards[0]))
+
+// resolution of the timing wheel, in seconds
+#define WHEEL_TICK 0.1
+
+#define STATS_INTERVAL 60
+
+// latency tracing: ingress events are sent as "@<receive time> <event>",
+// and egress may arrive as "@<enqueue time> <tags> <message>"; off, it
+// compiles away
+#define TRACE 0
+
+// admission control
+#define MAX_CLIENTS (1 << 20)
+#define MAX_CLIENTS_PER_IP 128
+
+// raw bytes held back from a throttled client before it is disconnected
+#define RATELIMIT_BACKLOG 65536
+
+// bytes of lines processed per client per loop iteration, so a bulk sender
+// cannot hold up everyone else; the rest is deferred to the next iteration
+#define READ_BUDGET 16384
+#define READ_BACKLOG (1 << 20)
+
+// egress buffered for a detached client, and how many such buffers may
+// exist at once; a session that outgrows either is disconnected, since
+// replaying it with a gap would be worse than a clean reconnect
+#define RESUME_BUFFER 65536
+#define RESUME_POOL 1024
+
+struct mux_replay {
+    struct mux_replay *next;
+    size_t len;
+    char data[RESUME_BUFFER];
+};
+
+static struct queue mq_out[SHARDS];
+static struct inbound mq_in[SHARDS];
+
+// list lengths from the last stats run, per shard, direction and lane
+static long long depth_out[SHARDS][LANES];
+static long long depth_in[SHARDS][LANES];
+
+static struct wheel wheel;
+static ev_timer wheel_watcher;
+
+static struct wheel_timer stats_timer;
+static uint64_t stats_replayed;
+
+static size_t clients;
+static struct iptable iptable;
+static uint32_t max_per_ip = MAX_CLIENTS_PER_IP;
+static uint64_t rejected;
+static uint64_t rejected_ip;
+
+static int ratelimit_on = 1;
+static uint64_t ratelimit_delayed;
+static uint64_t ratelimit_dropped;
+static uint64_t ratelimit_kicked;
 
-static struct rmq_context mq_out;
-static struct rmq_context mq_in;
+static size_t read_budget = READ_BUDGET;
+static TAILQ_HEAD(, mux_client) deferred = TAILQ_HEAD_INITIALIZER(deferred);
+static size_t deferred_count;
+static unsigned int budget_epoch;
+static ev_prepare budget_watcher;
+static ev_idle budget_idle;
+static uint64_t budget_deferred;
+
+// busy-poll mode: after any event the loop keeps polling without blocking
+// for spin_window seconds before it goes back to sleeping in the kernel
+static double spin_window;
+static double spin_until;
+static ev_idle spin_idle;
+static ev_prepare spin_watcher;
+static uint64_t spin_wakeups;
+static double spin_cpu;
+
+static char sanitized[3 * BUFFER_SIZE];
+static uint64_t utf8_invalid;
+
+static uint64_t handled_locally;
+
+// sequence number of the inbound message being fanned out
+static uint64_t popped;
+
+static int urandom = -1;
+static struct mux_replay *replay_free;
+static size_t replay_count;
+static uint64_t resume_detached;
+static uint64_t resume_resumed;
+static uint64_t resume_expired;
+
+// attached clients, packed
+static struct mux_slot *slots;
+static size_t slots_len;
+static size_t slots_size;
+
+static struct trace_histogram trace_wait[LANES];
+static struct trace_histogram trace_fanout;
+static struct trace_slow trace_slow;
+
+static struct capture capture;
+static int capturing;
+static uint32_t streams;
+
+// push an ingress event, stamped with the time it was read when tracing
+static void mux_client_push(struct mux_client *client, const char *prefix,
+    size_t prefix_len, const char *data, size_t len)
+{
+    if (!TRACE) {
+        queue_pushv(client->queue, LANE_NORMAL, prefix, prefix_len, data,
+            len);
+        return;
+    }
+
+    char stamp[BUFFER_SIZE + 32];
+    int n = snprintf(stamp, 32, "@%.6f ", client->last_active);
+    memcpy(stamp + n, prefix, prefix_len);
+    queue_pushv(client->queue, LANE_NORMAL, stamp, n + prefix_len, data,
+        len);
+}
 
 static int mux_client_cmp(struct mux_client *e1, struct mux_client *e2)
 {
@@ -51,40 +185,468 @@ static int mux_client_cmp(struct mux_client *e1, struct mux_client *e2)
 RB_HEAD(mux_client_tree, mux_client) head = RB_INITIALIZER(&head);
 RB_GENERATE(mux_client_tree, mux_client, entry, mux_client_cmp);
 
-static struct mux_client *mux_client_new(struct sev_stream *stream)
+static int mux_token_cmp(struct mux_client *e1, struct mux_client *e2)
+{
+    return strcmp(e1->token, e2->token);
+}
+
+RB_HEAD(mux_token_tree, mux_client) tokens = RB_INITIALIZER(&tokens);
+RB_GENERATE(mux_token_tree, mux_client, token_entry, mux_token_cmp);
+
+static void mux_client_close(struct mux_client *client, const char *reason);
+
+static void mux_client_timeout(struct wheel_timer *timer)
+{
+    struct mux_client *client = timer->data;
+    double idle = ev_now(EV_DEFAULT) - client->last_active;
+
+    switch (client->state) {
+    case MUX_REJECTED:
+        sev_close(client->stream, "connection limit");
+        break;
+
+    case MUX_HANDSHAKE:
+        sev_close(client->stream, "handshake timeout");
+        break;
+
+    case MUX_ACTIVE:
+        if (idle < PING_INTERVAL) {
+            mux_timer_add(timer, PING_INTERVAL - idle);
+            break;
+        }
+
+        client->state = MUX_PINGED;
+        if (client->listener->protocol->server_ping)
+            client->listener->protocol->server_ping(client);
+        mux_timer_add(timer, PING_TIMEOUT);
+        break;
+
+    case MUX_PINGED:
+        // anything received since the ping counts as a pong
+        if (idle < PING_TIMEOUT) {
+            client->state = MUX_ACTIVE;
+            mux_timer_add(timer, PING_INTERVAL - idle);
+            break;
+        }
+
+        sev_close(client->stream, "ping timeout");
+        break;
+
+    case MUX_DETACHED:
+        resume_expired++;
+        mux_client_close(client, "resume timeout");
+        break;
+    }
+}
+
+static void mux_client_unthrottle(struct wheel_timer *timer);
+
+// jump consistent hash (Lamping & Veach) over an fnv-1a hash of the tag,
+// so adding a shard only moves 1/n of the clients
+static struct queue *mux_client_shard(const char *tag)
 {
+    uint64_t key = 14695981039346656037ULL;
+    for (; *tag; tag++)
+        key = (key ^ (unsigned char)*tag) * 1099511628211ULL;
+
+    int64_t b = -1, j = 0;
+    while (j < (int64_t)SHARDS) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1));
+    }
+
+    return &mq_out[b];
+}
+
+static struct mux_client *mux_client_new(struct mux_listener *listener,
+    struct sev_stream *stream)
+{
+    const struct mux_ratelimit *ratelimit = &listener->protocol->ratelimit;
     struct mux_client *client = malloc(sizeof(struct mux_client));
 
-    asprintf(&client->tag, "%s:%s-%d", name, stream->remote_address,
-        stream->remote_port);
+    asprintf(&client->tag, "%s:%s-%d", listener->protocol->name,
+        stream->remote_address, stream->remote_port);
+    client->listener = listener;
     client->stream = stream;
+    client->queue = mux_client_shard(client->tag);
+    client->opened = 0;
+    client->attached = 0;
+    client->flags = 0;
+    client->resumable = 0;
+    client->token[0] = '\0';
+    client->replay = NULL;
     sprintf(client->buffer, "message %s ", client->tag);
     client->buffer_len = strlen(client->buffer);
     client->buffer_start = client->buffer_len;
 
-    RB_INSERT(mux_client_tree, &head, client);
+    client->timer = (struct wheel_timer) {
+        .cb = mux_client_timeout,
+        .data = client,
+    };
+    client->state = MUX_ACTIVE;
+    mux_client_touch(client);
+    mux_timer_add(&client->timer, PING_INTERVAL);
+
+    // start with full buckets
+    client->line_tokens = ratelimit->lines * ratelimit->burst;
+    client->byte_tokens = ratelimit->bytes * ratelimit->burst;
+    client->refill = client->last_active;
+    client->throttled = 0;
+    client->backlog = NULL;
+    client->backlog_len = 0;
+    client->throttle = (struct wheel_timer) {
+        .cb = mux_client_unthrottle,
+        .data = client,
+    };
+    client->budget = read_budget;
+    client->budget_epoch = budget_epoch;
+    client->deferred = 0;
+
+    // before the client can be attached, since its slot records it; the
+    // handshake gets the same deadline as the protocol's own
+    client->tls = listener->tls ? tls_new(listener->tls) : NULL;
+    if (client->tls)
+        mux_client_state(client, MUX_HANDSHAKE);
 
     return client;
 }
 
+static struct mux_replay *mux_replay_get(void)
+{
+    struct mux_replay *replay = replay_free;
+
+    if (replay)
+        replay_free = replay->next;
+    else if (replay_count < RESUME_POOL) {
+        replay = malloc(sizeof(struct mux_replay));
+        replay_count++;
+    }
+    else
+        return NULL;
+
+    replay->len = 0;
+
+    return replay;
+}
+
+static void mux_client_undefer(struct mux_client *client)
+{
+    if (!client->deferred)
+        return;
+
+    TAILQ_REMOVE(&deferred, client, deferred_entry);
+    deferred_count--;
+    client->deferred = 0;
+}
+
+static void mux_replay_put(struct mux_replay *replay)
+{
+    if (replay == NULL)
+        return;
+
+    replay->next = replay_free;
+    replay_free = replay;
+}
+
+static void mux_slot_add(struct mux_client *client)
+{
+    if (slots_len == slots_size) {
+        slots_size = slots_size ? 2 * slots_size : 1024;
+        slots = realloc(slots, slots_size * sizeof(struct mux_slot));
+    }
+
+    client->slot = slots_len++;
+    slots[client->slot] = (struct mux_slot) {
+        .stream = client->stream,
+        .listener = client->listener,
+        .client = client,
+        .flags = client->flags | (client->tls ? MUX_FLAG_TLS : 0),
+    };
+}
+
+// the last slot moves into the hole
+static void mux_slot_del(struct mux_client *client)
+{
+    struct mux_slot *last = &slots[--slots_len];
+
+    slots[client->slot] = *last;
+    last->client->slot = client->slot;
+}
+
 static void mux_client_free(struct mux_client *client)
 {
-    RB_REMOVE(mux_client_tree, &head, client);
+    if (client->attached) {
+        RB_REMOVE(mux_client_tree, &head, client);
+        mux_slot_del(client);
+    }
+
+    if (client->token[0])
+        RB_REMOVE(mux_token_tree, &tokens, client);
+
+    // detached clients gave back their admission slot already
+    if (client->state != MUX_REJECTED && client->state != MUX_DETACHED) {
+        iptable_del(&iptable, client->stream->remote_address);
+        clients--;
+    }
+
+    wheel_del(&client->timer);
+    wheel_del(&client->throttle);
+    mux_client_undefer(client);
 
+    mux_replay_put(client->replay);
+    tls_free(client->tls);
+    free(client->backlog);
     free(client->tag);
     free(client);
 }
 
-struct mux_client *mux_client_open(struct sev_stream *stream)
+static int mux_client_admit(struct sev_stream *stream)
+{
+    if (clients >= MAX_CLIENTS) {
+        rejected++;
+        return -1;
+    }
+
+    if (iptable_add(&iptable, stream->remote_address,
+            max_per_ip) == -1) {
+        rejected_ip++;
+        return -1;
+    }
+
+    clients++;
+    return 0;
+}
+
+// the stream can't be closed from inside open_cb, so rejected clients get
+// a placeholder that is closed on the next tick, without the kernel ever
+// seeing it
+static struct mux_client *mux_client_reject(struct mux_listener *listener,
+    struct sev_stream *stream)
+{
+    struct mux_client *client = calloc(1, sizeof(struct mux_client));
+
+    client->listener = listener;
+    client->stream = stream;
+    client->state = MUX_REJECTED;
+    client->last_active = ev_now(EV_DEFAULT);
+    client->timer = (struct wheel_timer) {
+        .cb = mux_client_timeout,
+        .data = client,
+    };
+    mux_timer_add(&client->timer, 0);
+
+    return client;
+}
+
+static struct mux_client *mux_client_open(struct mux_listener *listener,
+    struct sev_stream *stream)
 {
-    struct mux_client *client = mux_client_new(stream);
+    if (mux_client_admit(stream) == -1)
+        return mux_client_reject(listener, stream);
+
+    struct mux_client *client = mux_client_new(listener, stream);
 
     printf("open %s\n", client->tag);
 
-    rmq_rpushf(&mq_out, "connect %s %s", client->tag,
+    return client;
+}
+
+// hand the client to the protocol, announcing it unless the protocol
+// resumes sessions and does so itself
+static void mux_client_start(struct mux_client *client)
+{
+    const struct mux_protocol *protocol = client->listener->protocol;
+
+    client->opened = 1;
+
+    if (client->tls)
+        mux_client_state(client, MUX_ACTIVE);
+
+    if (!protocol->resume)
+        mux_client_resume(client, NULL);
+
+    if (protocol->open)
+        protocol->open(client);
+}
+
+static void mux_client_connect(struct mux_client *client)
+{
+    client->attached = 1;
+    RB_INSERT(mux_client_tree, &head, client);
+    mux_slot_add(client);
+
+    queue_pushf(client->queue, LANE_HIGH, "connect %s %s", client->tag,
         client->stream->remote_address);
+}
 
-    return client;
+static void mux_client_token(struct mux_client *client)
+{
+    unsigned char random[MUX_TOKEN_SIZE / 2];
+
+    if (read(urandom, random, sizeof(random)) != sizeof(random))
+        return;
+
+    for (int i = 0; i < sizeof(random); i++)
+        sprintf(client->token + 2 * i, "%02x", random[i]);
+
+    client->resumable = 1;
+    RB_INSERT(mux_token_tree, &tokens, client);
+
+    client->listener->protocol->server_token(client, client->token);
+}
+
+// send everything the session missed while it was detached
+static void mux_client_replay(struct mux_client *client,
+    struct mux_replay *replay)
+{
+    struct mux_listener *listener = client->listener;
+    const struct mux_protocol *protocol = listener->protocol;
+
+    for (size_t pos = 0; pos < replay->len; ) {
+        uint32_t len;
+        memcpy(&len, replay->data + pos, sizeof(len));
+
+        char *message = replay->data + pos + sizeof(len);
+        size_t message_len = len;
+        pos += sizeof(len) + len;
+
+        if (protocol->process_message)
+            message = protocol->process_message(message, &message_len);
+
+        protocol->server_message(client, message, message_len);
+    }
+
+    // process_message() may keep per-message state of its own
+    listener->processed = 0;
+
+    mux_replay_put(replay);
+}
+
+// the new connection takes over the tag, queue and token of the old
+// session, which is dropped without the kernel noticing
+static void mux_client_adopt(struct mux_client *client,
+    struct mux_client *old)
+{
+    RB_REMOVE(mux_client_tree, &head, old);
+    RB_REMOVE(mux_token_tree, &tokens, old);
+    mux_slot_del(old);
+    old->attached = 0;
+
+    char *tag = client->tag;
+    client->tag = old->tag;
+    old->tag = tag;
+
+    client->queue = old->queue;
+    memcpy(client->token, old->token, sizeof(client->token));
+    old->token[0] = '\0';
+
+    struct mux_replay *replay = old->replay;
+    old->replay = NULL;
+
+    sprintf(client->buffer, "message %s ", client->tag);
+    client->buffer_len = strlen(client->buffer);
+    client->buffer_start = client->buffer_len;
+
+    // the old connection may not have noticed it is gone yet
+    if (old->state == MUX_DETACHED)
+        mux_client_free(old);
+    else {
+        old->resumable = 0;
+        sev_close(old->stream, "resumed");
+    }
+
+    client->attached = 1;
+    client->resumable = 1;
+    RB_INSERT(mux_client_tree, &head, client);
+    mux_slot_add(client);
+    RB_INSERT(mux_token_tree, &tokens, client);
+
+    resume_resumed++;
+    printf("resume %s\n", client->tag);
+
+    if (replay)
+        mux_client_replay(client, replay);
+}
+
+void mux_client_resume(struct mux_client *client, const char *token)
+{
+    if (client->attached || client->state == MUX_REJECTED)
+        return;
+
+    if (token && *token) {
+        struct mux_client key;
+        snprintf(key.token, sizeof(key.token), "%s", token);
+
+        struct mux_client *old = RB_FIND(mux_token_tree, &tokens, &key);
+        if (old && old->listener->protocol == client->listener->protocol) {
+            mux_client_adopt(client, old);
+            return;
+        }
+    }
+
+    mux_client_connect(client);
+
+    if (token)
+        mux_client_token(client);
+}
+
+// keep the session for the grace period, buffering what is sent to it
+static int mux_client_detach(struct mux_client *client, const char *reason)
+{
+    client->replay = mux_replay_get();
+    if (client->replay == NULL)
+        return -1;
+
+    iptable_del(&iptable, client->stream->remote_address);
+    clients--;
+
+    client->stream = NULL;
+    client->data = NULL;
+    client->state = MUX_DETACHED;
+    tls_free(client->tls);
+    client->tls = NULL;
+
+    if (client->attached)
+        slots[client->slot].flags |= MUX_FLAG_DETACHED;
+    mux_timer_add(&client->timer, client->listener->protocol->resume);
+
+    wheel_del(&client->throttle);
+    client->throttled = 0;
+    mux_client_undefer(client);
+    free(client->backlog);
+    client->backlog = NULL;
+    client->backlog_len = 0;
+
+    resume_detached++;
+    printf("detach %s %s\n", client->tag, reason);
+
+    return 0;
+}
+
+// messages are kept with a length prefix, since binary ones may hold NULs
+static int mux_client_buffer(struct mux_client *client, char *message,
+    size_t len)
+{
+    struct mux_replay *replay = client->replay;
+    uint32_t prefix = len;
+
+    if (replay->len + sizeof(prefix) + len > RESUME_BUFFER)
+        return -1;
+
+    memcpy(replay->data + replay->len, &prefix, sizeof(prefix));
+    memcpy(replay->data + replay->len + sizeof(prefix), message, len);
+    replay->len += sizeof(prefix) + len;
+
+    return 0;
+}
+
+// closed on purpose, so there is nothing to resume; through the protocol,
+// which may be in the middle of parsing and have to finish before closing
+static void mux_client_kick(struct mux_client *client, const char *reason)
+{
+    client->resumable = 0;
+    client->listener->protocol->server_error(client, 1008, reason);
 }
 
 static int find_delimiter(const char *data, size_t len)
@@ -96,85 +658,1075 @@ static int find_delimiter(const char *data, size_t len)
     return -1;
 }
 
-void mux_client_data(struct mux_client *client, char *data, size_t len)
+// refill the buckets lazily, then take one line and its bytes; returns how
+// long to wait if there are not enough tokens yet
+static double mux_client_tokens(struct mux_client *client, size_t bytes)
 {
-    while (len != 0) {
-        int pos = find_delimiter(data, len);
+    const struct mux_ratelimit *ratelimit =
+        &client->listener->protocol->ratelimit;
 
-        int n = pos == -1 ? len : pos;
+    if (!ratelimit_on || (!ratelimit->lines && !ratelimit->bytes))
+        return 0;
 
-        int rest = (BUFFER_SIZE - 1) - client->buffer_len;
-        if (n > rest)
-            n = rest;
+    ev_tstamp now = ev_now(EV_DEFAULT);
+    double elapsed = now - client->refill;
+    double wait = 0;
+    double need = 0;
 
-        // append data (up to \n) to the buffer
-        memcpy(client->buffer + client->buffer_len, data, n);
-        client->buffer_len += n;
-        client->buffer[client->buffer_len] = '\0';
+    client->refill = now;
 
-        // did not find a \n -- wait for the rest of the message
-        if (pos == -1)
-            return;
+    if (ratelimit->lines) {
+        double max = ratelimit->lines * ratelimit->burst;
+
+        client->line_tokens += elapsed * ratelimit->lines;
+        if (client->line_tokens > max)
+            client->line_tokens = max;
+
+        if (client->line_tokens < 1)
+            wait = (1 - client->line_tokens) / ratelimit->lines;
+    }
 
-        // terminate string on the first \r
-        char *p = strchr(client->buffer, '\r');
-        if (p)
-            *p = '\0';
+    if (ratelimit->bytes) {
+        double max = ratelimit->bytes * ratelimit->burst;
 
-        printf("%s\n", client->buffer);
-        rmq_rpush(&mq_out, client->buffer);
+        // a line longer than the whole bucket only needs a full bucket
+        need = bytes < max ? bytes : max;
+
+        client->byte_tokens += elapsed * ratelimit->bytes;
+        if (client->byte_tokens > max)
+            client->byte_tokens = max;
+
+        if (client->byte_tokens < need) {
+            double byte_wait = (need - client->byte_tokens) / ratelimit->bytes;
+            if (byte_wait > wait)
+                wait = byte_wait;
+        }
+    }
+
+    if (wait > 0)
+        return wait;
+
+    client->line_tokens -= 1;
+    client->byte_tokens -= need;
+
+    return 0;
+}
+
+// push the complete line in the buffer; returns 1 if the client is
+// throttled and the line is still pending, -1 if the client was closed
+static int mux_client_line(struct mux_client *client)
+{
+    const struct mux_protocol *protocol = client->listener->protocol;
+
+    // terminate string on the first \r
+    char *p = strchr(client->buffer, '\r');
+    if (p)
+        *p = '\0';
+
+    size_t len = strlen(client->buffer);
+    double wait = mux_client_tokens(client, len - client->buffer_start);
+
+    if (wait > 0) {
+        switch (protocol->ratelimit.action) {
+        case RATELIMIT_DELAY:
+            ratelimit_delayed++;
+            client->throttled = 1;
+            mux_timer_add(&client->throttle, wait);
+            return 1;
+
+        case RATELIMIT_DROP:
+            ratelimit_dropped++;
+            client->buffer_len = client->buffer_start;
+            return 0;
+
+        case RATELIMIT_DISCONNECT:
+            ratelimit_kicked++;
+            mux_client_kick(client, "excess flood");
+            return -1;
+        }
+    }
+
+    char *line = client->buffer;
+    char *text = line + client->buffer_start;
+    size_t text_len = len - client->buffer_start;
+
+    // line protocols that resume are announced on the first line, which
+    // may ask for a token with "RESUME" or present one with "RESUME <token>"
+    if (!client->attached) {
+        if (!strncmp(text, "RESUME", 6) && (!text[6] || text[6] == ' ')) {
+            mux_client_resume(client, text[6] ? text + 7 : "");
+            client->buffer_len = client->buffer_start;
+            return 0;
+        }
+
+        mux_client_resume(client, NULL);
+    }
+
+    if (protocol->client_message &&
+            protocol->client_message(client, text, text_len)) {
+        handled_locally++;
         client->buffer_len = client->buffer_start;
+        return 0;
+    }
 
-        // discard data before the delimiter, and the delimiter
-        data += pos + 1;
-        len -= pos + 1;
+    if (protocol->utf8_ingress != UTF8_PASS && !utf8_valid(text, text_len)) {
+        utf8_invalid++;
+
+        if (protocol->utf8_ingress == UTF8_REJECT) {
+            client->resumable = 0;
+            protocol->server_error(client, 1007, "invalid utf-8");
+            return -1;
+        }
+
+        memcpy(sanitized, line, client->buffer_start);
+        len = client->buffer_start +
+            utf8_sanitize(sanitized + client->buffer_start, text, text_len);
+        sanitized[len] = '\0';
+        line = sanitized;
+    }
+
+    printf("%s\n", line);
+    mux_client_push(client, line, client->buffer_start,
+        line + client->buffer_start, len - client->buffer_start);
+    client->buffer_len = client->buffer_start;
+
+    return 0;
+}
+
+// returns -1 if the client was kicked
+static int mux_client_backlog(struct mux_client *client, char *data,
+    size_t len)
+{
+    size_t limit = client->throttled ? RATELIMIT_BACKLOG : READ_BACKLOG;
+
+    if (client->backlog_len + len > limit) {
+        ratelimit_kicked++;
+        mux_client_kick(client, "excess flood");
+        return -1;
     }
+
+    client->backlog = realloc(client->backlog, client->backlog_len + len);
+    memcpy(client->backlog + client->backlog_len, data, len);
+    client->backlog_len += len;
+
+    return 0;
 }
 
-void mux_client_close(struct mux_client *client, const char *reason)
+static void mux_client_unthrottle(struct wheel_timer *timer)
 {
-    printf("close %s %s\n", client->tag, reason);
+    struct mux_client *client = timer->data;
 
-    rmq_rpushf(&mq_out, "disconnect %s %s", client->tag, reason);
+    if (mux_client_line(client) != 0)
+        return;
 
-    mux_client_free(client);
+    char *data = client->backlog;
+    size_t len = client->backlog_len;
+
+    client->throttled = 0;
+    client->backlog = NULL;
+    client->backlog_len = 0;
+
+    mux_client_data(client, data, len);
+    free(data);
 }
 
-static void blpop_cb(char *reply)
+// hold the rest of the data back until the next loop iteration
+static void mux_client_defer(struct mux_client *client, char *data,
+    size_t len)
 {
-    char *tags = reply;
-    char *message = strchr(tags, ' ');
-    *message++ = '\0';
+    if (mux_client_backlog(client, data, len) == -1)
+        return;
 
-    process_message(message);
+    budget_deferred++;
+    client->deferred = 1;
+    TAILQ_INSERT_TAIL(&deferred, client, deferred_entry);
 
-    char *tag = strtok(tags, ",");
-    for (; tag != NULL; tag = strtok(NULL, ",")) {
-        struct mux_client key = { .tag = tag };
-        struct mux_client *client = RB_FIND(mux_client_tree, &head, &key);
+    // keep the loop from blocking while there is work left
+    if (deferred_count++ == 0)
+        ev_idle_start(EV_DEFAULT_ &budget_idle);
+}
 
-        if (client == NULL)
-            continue;
+// runs once every loop iteration, after all callbacks: start a new budget
+// and give every client deferred so far one more share, in turn
+static void budget_cb(EV_P_ ev_prepare *watcher, int revents)
+{
+    budget_epoch++;
 
-        if (!*message) {
-            server_close(client);
-            continue;
-        }
+    if (deferred_count == 0)
+        return;
 
-        server_message(client, message);
+    double start = profile_begin();
+    size_t n = deferred_count, bytes = 0;
+
+    while (n-- && !TAILQ_EMPTY(&deferred)) {
+        struct mux_client *client = TAILQ_FIRST(&deferred);
+        mux_client_undefer(client);
+
+        char *data = client->backlog;
+        size_t len = client->backlog_len;
+
+        client->backlog = NULL;
+        client->backlog_len = 0;
+        bytes += len;
+
+        mux_client_data(client, data, len);
+        free(data);
     }
+
+    if (deferred_count == 0)
+        ev_idle_stop(EV_A_ &budget_idle);
+
+    profile_end(PROFILE_READ, start, "deferred", bytes);
 }
 
-void mux_init(void)
+static void budget_idle_cb(EV_P_ ev_idle *watcher, int revents)
 {
-    rmq_init(&mq_out, REDIS_HOST, REDIS_PORT, REDIS_DB, "mq:kernel");
-    rmq_rpushf(&mq_out, "reset %s server restart", name);
+}
+
+void mux_client_data(struct mux_client *client, char *data, size_t len)
+{
+    if (client->state == MUX_REJECTED)
+        return;
+
+    // while a line is held back, everything else waits behind it
+    if (client->throttled || client->deferred) {
+        if (len)
+            mux_client_backlog(client, data, len);
+        return;
+    }
+
+    if (client->budget_epoch != budget_epoch) {
+        client->budget_epoch = budget_epoch;
+        client->budget = read_budget;
+    }
+
+    while (len != 0) {
+        int pos = find_delimiter(data, len);
+
+        int n = pos == -1 ? len : pos;
+
+        int rest = (BUFFER_SIZE - 1) - client->buffer_len;
+        if (n > rest)
+            n = rest;
+
+        // append data (up to \n) to the buffer
+        memcpy(client->buffer + client->buffer_len, data, n);
+        client->buffer_len += n;
+        client->buffer[client->buffer_len] = '\0';
+
+        // did not find a \n -- wait for the rest of the message
+        if (pos == -1)
+            return;
+
+        // discard data before the delimiter, and the delimiter
+        data += pos + 1;
+        len -= pos + 1;
+
+        size_t used = pos + 1;
+        client->budget -= used < client->budget ? used : client->budget;
+
+        int ret = mux_client_line(client);
+        if (ret == -1)
+            return;
+
+        if (ret == 1) {
+            if (len)
+                mux_client_backlog(client, data, len);
+            return;
+        }
+
+        if (read_budget && client->budget == 0 && len) {
+            mux_client_defer(client, data, len);
+            return;
+        }
+    }
+}
+
+int mux_client_message(struct mux_client *client, int binary, char *data,
+    size_t len)
+{
+    const struct mux_protocol *protocol = client->listener->protocol;
+
+    if (client->state == MUX_REJECTED)
+        return 0;
+
+    // a whole message can't be held back like a line, so delay drops it
+    if (mux_client_tokens(client, len) > 0) {
+        if (protocol->ratelimit.action == RATELIMIT_DISCONNECT) {
+            ratelimit_kicked++;
+            mux_client_kick(client, "excess flood");
+            return -1;
+        }
+
+        ratelimit_dropped++;
+        return 0;
+    }
+
+    if (binary) {
+        char prefix[BUFFER_SIZE];
+        int prefix_len = snprintf(prefix, sizeof(prefix), "binary %s ",
+            client->tag);
+
+        printf("binary %s (%zu bytes)\n", client->tag, len);
+        mux_client_push(client, prefix, prefix_len, data, len);
+        return 0;
+    }
+
+    char *fixed = NULL;
+
+    if (protocol->utf8_ingress != UTF8_PASS && !utf8_valid(data, len)) {
+        utf8_invalid++;
+
+        if (protocol->utf8_ingress == UTF8_REJECT) {
+            client->resumable = 0;
+            protocol->server_error(client, 1007, "invalid utf-8");
+            return -1;
+        }
+
+        fixed = malloc(3 * len);
+        len = utf8_sanitize(fixed, data, len);
+        data = fixed;
+    }
+
+    // the "message <tag> " prefix is always at the start of the buffer
+    printf("%.*s%.*s\n", client->buffer_start, client->buffer, (int)len, data);
+    mux_client_push(client, client->buffer, client->buffer_start, data, len);
+
+    free(fixed);
+    return 0;
+}
+
+static void mux_client_close(struct mux_client *client, const char *reason)
+{
+    if (client->state == MUX_REJECTED) {
+        mux_client_free(client);
+        return;
+    }
+
+    printf("close %s %s\n", client->tag, reason);
+
+    if (client->attached)
+        queue_pushf(client->queue, LANE_HIGH, "disconnect %s %s",
+            client->tag, reason);
+
+    mux_client_free(client);
+}
+
+int mux_send(struct mux_client *client, const char *data, size_t len)
+{
+    if (client->tls)
+        return tls_write(client->tls, client->stream, data, len);
+
+    return sev_send(client->stream, data, len);
+}
+
+void mux_client_touch(struct mux_client *client)
+{
+    client->last_active = ev_now(EV_DEFAULT);
+}
+
+void mux_client_state(struct mux_client *client, int state)
+{
+    if (client->state == MUX_REJECTED)
+        return;
+
+    client->state = state;
+
+    if (state == MUX_HANDSHAKE)
+        mux_timer_add(&client->timer, HANDSHAKE_TIMEOUT);
+    else
+        mux_timer_add(&client->timer, PING_INTERVAL);
+}
+
+static uint64_t wheel_ticks(void)
+{
+    return ev_now(EV_DEFAULT) / WHEEL_TICK;
+}
+
+void mux_timer_add(struct wheel_timer *timer, double seconds)
+{
+    wheel_add(&wheel, timer, seconds / WHEEL_TICK);
+}
+
+static void wheel_cb(EV_P_ ev_timer *watcher, int revents)
+{
+    double start = profile_begin();
+
+    wheel_advance(&wheel, wheel_ticks());
+
+    profile_end(PROFILE_TIMERS, start, NULL, 0);
+}
+
+static void mux_capture_write(int type, uint32_t stream, int port,
+    const char *data, size_t len)
+{
+    if (capture_write(&capture, ev_now(EV_DEFAULT), type, stream, port, data,
+            len) == -1) {
+        printf("capture full\n");
+        capturing = 0;
+    }
+}
+
+static void mux_spin(void)
+{
+    if (spin_window == 0)
+        return;
+
+    spin_until = ev_now(EV_DEFAULT) + spin_window;
+
+    if (!ev_is_active(&spin_idle)) {
+        spin_wakeups++;
+        ev_idle_start(EV_DEFAULT_ &spin_idle);
+    }
+}
+
+static void spin_idle_cb(EV_P_ ev_idle *watcher, int revents)
+{
+}
+
+static void spin_cb(EV_P_ ev_prepare *watcher, int revents)
+{
+    if (ev_is_active(&spin_idle) && ev_now(EV_A) > spin_until)
+        ev_idle_stop(EV_A_ &spin_idle);
+}
+
+// cpu time used since the last report against wakeups from sleep; the
+// latency side of the trade-off is in the trace and replay reports
+static void mux_spin_stats(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    double cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+
+    printf("stats busypoll cpu %.1f%% wakeups %llu\n",
+        100 * (cpu - spin_cpu) / STATS_INTERVAL,
+        (unsigned long long)spin_wakeups);
+
+    spin_cpu = cpu;
+    spin_wakeups = 0;
+}
+
+static void mux_trace_stats(void)
+{
+    for (int lane = 0; lane < LANES; lane++) {
+        struct trace_histogram *wait = &trace_wait[lane];
+
+        if (wait->count)
+            printf("stats trace wait %s p50 %.6f p99 %.6f max %.6f\n",
+                lane == LANE_HIGH ? "high" : "normal",
+                trace_quantile(wait, 0.5), trace_quantile(wait, 0.99),
+                wait->max);
+    }
+
+    if (trace_fanout.count) {
+        printf("stats trace fanout p50 %.6f p99 %.6f max %.6f\n",
+            trace_quantile(&trace_fanout, 0.5),
+            trace_quantile(&trace_fanout, 0.99), trace_fanout.max);
+    }
+
+    for (int i = 0; i < trace_slow.count; i++) {
+        struct trace_sample *sample = &trace_slow.samples[i];
+        printf("stats trace slow %.6f wait %.6f recipients %zu %s\n",
+            sample->latency, sample->wait, sample->recipients,
+            sample->text);
+    }
+
+    memset(trace_wait, 0, sizeof(trace_wait));
+    memset(&trace_fanout, 0, sizeof(trace_fanout));
+    memset(&trace_slow, 0, sizeof(trace_slow));
+}
+
+// events pushed and popped per lane since startup, and the list lengths
+// sampled on the previous run
+static void mux_lane_stats(void)
+{
+    uint64_t pushed[LANES] = { 0 }, pulled[LANES] = { 0 };
+    long long out[LANES] = { 0 }, in[LANES] = { 0 };
+
+    for (int i = 0; i < SHARDS; i++) {
+        for (int lane = 0; lane < LANES; lane++) {
+            pushed[lane] += mq_out[i].pushed[lane];
+            pulled[lane] += mq_in[i].popped[lane];
+            out[lane] += depth_out[i][lane];
+            in[lane] += depth_in[i][lane];
+
+            queue_llen(&mq_out[i], mq_out[i].keys[lane], &depth_out[i][lane]);
+            queue_llen(&mq_out[i], mq_in[i].keys[lane], &depth_in[i][lane]);
+        }
+    }
+
+    printf("stats lanes kernel high %llu (%lld queued) normal %llu "
+        "(%lld queued)\n", (unsigned long long)pushed[LANE_HIGH],
+        out[LANE_HIGH], (unsigned long long)pushed[LANE_NORMAL],
+        out[LANE_NORMAL]);
+    printf("stats lanes " NAME " high %llu (%lld queued) normal %llu "
+        "(%lld queued)\n", (unsigned long long)pulled[LANE_HIGH],
+        in[LANE_HIGH], (unsigned long long)pulled[LANE_NORMAL],
+        in[LANE_NORMAL]);
+}
+
+static void stats_cb(struct wheel_timer *timer)
+{
+    size_t depth = 0;
+    uint64_t replayed = 0, dropped = 0;
+
+    for (int i = 0; i < SHARDS; i++) {
+        depth += spool_depth(&mq_out[i].spool);
+        replayed += mq_out[i].replayed;
+        dropped += mq_out[i].spool.dropped;
+    }
+
+    uint64_t delta = replayed - stats_replayed;
+    stats_replayed = replayed;
+
+    if (depth || delta || dropped)
+        printf("stats spool %zu replayed %llu (%.1f/s) dropped %llu\n",
+            depth, (unsigned long long)delta,
+            (double)delta / STATS_INTERVAL, (unsigned long long)dropped);
+
+    if (rejected || rejected_ip)
+        printf("stats clients %zu rejected %llu per-ip %llu\n", clients,
+            (unsigned long long)rejected, (unsigned long long)rejected_ip);
+
+    if (ratelimit_delayed || ratelimit_dropped || ratelimit_kicked)
+        printf("stats ratelimit delayed %llu dropped %llu kicked %llu\n",
+            (unsigned long long)ratelimit_delayed,
+            (unsigned long long)ratelimit_dropped,
+            (unsigned long long)ratelimit_kicked);
+
+    if (utf8_invalid)
+        printf("stats utf8 invalid %llu\n", (unsigned long long)utf8_invalid);
+
+    if (handled_locally)
+        printf("stats handled locally %llu\n",
+            (unsigned long long)handled_locally);
+
+    if (budget_deferred)
+        printf("stats read budget deferred %llu pending %zu\n",
+            (unsigned long long)budget_deferred, deferred_count);
+
+    if (resume_detached)
+        printf("stats resume detached %llu resumed %llu expired %llu "
+            "buffers %zu\n", (unsigned long long)resume_detached,
+            (unsigned long long)resume_resumed,
+            (unsigned long long)resume_expired, replay_count);
+
+    mux_lane_stats();
+
+    if (spin_window)
+        mux_spin_stats();
+
+    if (TRACE)
+        mux_trace_stats();
+
+    profile_stats();
+
+    mux_timer_add(timer, STATS_INTERVAL);
+}
+
+// each listener's process_message() runs at most once per inbound message,
+// and only if one of the recipients is on that listener
+static char *mux_listener_egress(struct mux_listener *listener, char *message,
+    size_t *len)
+{
+    if (listener->processed == popped) {
+        *len = listener->egress_len;
+        return listener->egress;
+    }
+
+    listener->processed = popped;
+    listener->egress = message;
+    listener->egress_len = *len;
+
+    if (listener->protocol->process_message)
+        listener->egress = listener->protocol->process_message(message,
+            &listener->egress_len);
+
+    *len = listener->egress_len;
+    return listener->egress;
+}
+
+// time spent in mq:mux, if the kernel stamped the message, and time spent
+// handing it to every recipient's socket
+static void mux_trace_egress(int lane, double enqueued, double start,
+    const char *tag, const char *message, size_t recipients)
+{
+    double now = ev_time();
+    double wait = enqueued ? start - enqueued : 0;
+    double fanout = now - start;
+
+    if (enqueued)
+        trace_record(&trace_wait[lane], wait);
+    trace_record(&trace_fanout, fanout);
+
+    char text[64];
+    snprintf(text, sizeof(text), "%s %s", tag, message);
+    trace_sample(&trace_slow, wait + fanout, wait, recipients, text);
+}
+
+// hand one inbound message to a client; an empty message closes it.
+// returns 1 if the message was sent
+static int mux_deliver(struct mux_client *client, char *message, size_t len)
+{
+    const struct mux_protocol *protocol = client->listener->protocol;
+
+    if (client->state == MUX_DETACHED) {
+        if (!len)
+            mux_client_close(client, "server_close");
+        else if (mux_client_buffer(client, message, len) == -1)
+            mux_client_close(client, "resume buffer full");
+        return 0;
+    }
+
+    if (!len) {
+        client->resumable = 0;
+        protocol->server_close(client);
+        return 0;
+    }
+
+    message = mux_listener_egress(client->listener, message, &len);
+    protocol->server_message(client, message, len);
+
+    return 1;
+}
+
+static void mux_kick(struct mux_client *client, const char *reason)
+{
+    if (client->state == MUX_DETACHED) {
+        mux_client_close(client, reason);
+        return;
+    }
+
+    client->resumable = 0;
+    client->listener->protocol->server_error(client, 1008, reason);
+}
+
+// "!<op> <prefix> [<argument>]" acts on every client whose tag starts with
+// the prefix, as one range scan of the registry:
+//   !kick <prefix> <reason>
+//   !send <prefix> <message>
+//   !count <prefix>
+//   !list <prefix>
+// and answers with a single "<op> <prefix> <count>[ <tags>]" event
+static void mux_control(char *command, char *end)
+{
+    char *prefix = strchr(command, ' ');
+    if (prefix == NULL)
+        return;
+    *prefix++ = '\0';
+
+    char *argument = strchr(prefix, ' ');
+    if (argument)
+        *argument++ = '\0';
+    else
+        argument = end;
+
+    int kick = !strcmp(command, "kick");
+    int send = !strcmp(command, "send");
+    int list = !strcmp(command, "list");
+
+    if (!kick && !send && !list && strcmp(command, "count")) {
+        printf("unknown control message %s\n", command);
+        return;
+    }
+
+    // an empty message would close every matching client
+    if (send && argument == end) {
+        printf("control send %s without a message\n", prefix);
+        return;
+    }
+
+    size_t prefix_len = strlen(prefix);
+    size_t count = 0;
+    char *tags = NULL;
+    size_t tags_len = 0, tags_size = 0;
+
+    struct mux_client key = { .tag = prefix };
+    struct mux_client *client = RB_NFIND(mux_client_tree, &head, &key);
+
+    while (client && !strncmp(client->tag, prefix, prefix_len)) {
+        // kicking may take the client out of the tree
+        struct mux_client *next = RB_NEXT(mux_client_tree, &head, client);
+
+        if (list) {
+            size_t len = strlen(client->tag);
+            if (tags_len + len + 1 > tags_size) {
+                tags_size = 2 * (tags_len + len + 1);
+                tags = realloc(tags, tags_size);
+            }
+
+            tags[tags_len++] = count ? ',' : ' ';
+            memcpy(tags + tags_len, client->tag, len);
+            tags_len += len;
+        }
+        else if (kick)
+            mux_kick(client, *argument ? argument : "kicked");
+        else if (send)
+            mux_deliver(client, argument, end - argument);
+
+        count++;
+        client = next;
+    }
+
+    printf("control %s %s: %zu clients\n", command, prefix, count);
+
+    char result[BUFFER_SIZE];
+    int len = snprintf(result, sizeof(result), "%s %s %zu", command, prefix,
+        count);
+    if (len >= sizeof(result))
+        len = sizeof(result) - 1;
+
+    queue_pushv(mux_client_shard(prefix), LANE_HIGH, result, len, tags,
+        tags_len);
+
+    free(tags);
+}
+
+// the "*" target: every attached client, in one pass over the slots that
+// only reaches into a client record for detached and tls clients
+static size_t mux_broadcast(char *message, size_t len)
+{
+    size_t recipients = 0;
+
+    // walk backwards, so a client closed on the way only moves an already
+    // visited slot into its place
+    for (size_t i = slots_len; i-- > 0; ) {
+        if (i >= slots_len)
+            continue;
+
+        struct mux_slot *slot = &slots[i];
+
+        if ((slot->flags & MUX_FLAG_DETACHED) || !len) {
+            recipients += mux_deliver(slot->client, message, len);
+            continue;
+        }
+
+        const struct mux_protocol *protocol = slot->listener->protocol;
+        size_t egress_len = len;
+        char *egress = mux_listener_egress(slot->listener, message,
+            &egress_len);
+
+        if (protocol->server_broadcast && !(slot->flags & MUX_FLAG_TLS))
+            protocol->server_broadcast(slot->stream, slot->flags, egress,
+                egress_len);
+        else
+            protocol->server_message(slot->client, egress, egress_len);
+
+        recipients++;
+    }
+
+    return recipients;
+}
+
+static void mux_blpop(int lane, char *reply, size_t len)
+{
+    char *end = reply + len;
+    char *tags = reply;
+    double enqueued = 0;
+    double start = 0;
+    size_t recipients = 0;
+
+    if (TRACE) {
+        start = ev_time();
+
+        if (*tags == '@') {
+            enqueued = strtod(tags + 1, &tags);
+            tags += *tags == ' ';
+        }
+    }
+
+    popped++;
+
+    // tags never start with '!'
+    if (*tags == '!') {
+        mux_control(tags + 1, end);
+        return;
+    }
+
+    char *message = strchr(tags, ' ');
+    *message++ = '\0';
+    size_t message_len = end - message;
+
+    char *tag = strtok(tags, ",");
+    for (; tag != NULL; tag = strtok(NULL, ",")) {
+        if (!strcmp(tag, "*")) {
+            recipients += mux_broadcast(message, message_len);
+            continue;
+        }
+
+        struct mux_client key = { .tag = tag };
+        struct mux_client *client = RB_FIND(mux_client_tree, &head, &key);
+
+        if (client == NULL)
+            continue;
+
+        recipients += mux_deliver(client, message, message_len);
+    }
+
+    if (TRACE)
+        mux_trace_egress(lane, enqueued, start, tags, message, recipients);
+}
+
+static void blpop_cb(int lane, char *reply, size_t len)
+{
+    double start = profile_begin();
+
+    mux_spin();
+
+    // egress records keep the lane where opens keep the port
+    if (capturing)
+        mux_capture_write(CAPTURE_EGRESS, 0, lane, reply, len);
+
+    mux_blpop(lane, reply, len);
+
+    // the tags are split off in place, leaving the first one at the start
+    profile_end(PROFILE_BLPOP, start, reply, len);
+}
+
+void mux_init(void)
+{
+    wheel_init(&wheel, wheel_ticks());
+    ev_timer_init(&wheel_watcher, wheel_cb, WHEEL_TICK, WHEEL_TICK);
+    ev_timer_start(EV_DEFAULT_ &wheel_watcher);
+
+    stats_timer.cb = stats_cb;
+    mux_timer_add(&stats_timer, STATS_INTERVAL);
+
+    urandom = open("/dev/urandom", O_RDONLY);
+
+    profile_init();
+
+    // the epoch has to advance every iteration, deferred clients or not;
+    // unreferenced, so it doesn't keep the loop alive by itself
+    ev_prepare_init(&budget_watcher, budget_cb);
+    ev_prepare_start(EV_DEFAULT_ &budget_watcher);
+    ev_unref(EV_DEFAULT);
+    ev_idle_init(&budget_idle, budget_idle_cb);
+
+    for (int i = 0; i < SHARDS; i++) {
+        const char *host = redis_shards[i].host;
+        int port = redis_shards[i].port;
+
+        char *spool;
+        asprintf(&spool, "run/" NAME ".%d.spool", i);
+
+        queue_init(&mq_out[i], host, port, REDIS_DB, "mq:kernel", spool);
+
+        free(spool);
+
+        inbound_init(&mq_in[i], host, port, REDIS_DB, "mq:" NAME, blpop_cb);
+    }
+}
+
+static void open_cb(struct sev_stream *stream)
+{
+    double start = profile_begin();
+    struct mux_listener *listener = (struct mux_listener *)stream->server;
+    struct mux_client *client = mux_client_open(listener, stream);
+
+    mux_spin();
+
+    stream->data = client;
+    client->id = ++streams;
+
+    if (capturing) {
+        const char *tag = client->tag ? client->tag : "";
+        mux_capture_write(CAPTURE_OPEN, client->id, listener->port, tag,
+            strlen(tag));
+    }
+
+    // tls clients are started once the handshake is done
+    if (client->state != MUX_REJECTED && !client->tls)
+        mux_client_start(client);
+
+    profile_end(PROFILE_OPEN, start, client->tag, 0);
+}
+
+// run the handshake on what was read, and collect the plaintext in one
+// buffer, since the protocol may close the client while it reads
+static int mux_client_decrypt(struct mux_client *client, char **data,
+    size_t *len)
+{
+    static char *plain;
+    static size_t plain_size;
+
+    if (tls_feed(client->tls, client->stream, *data, *len) == -1)
+        return -1;
+
+    size_t plain_len = 0;
+
+    for (;;) {
+        if (plain_len == plain_size) {
+            plain_size = plain_size ? 2 * plain_size : 16384;
+            plain = realloc(plain, plain_size);
+        }
+
+        int n = tls_recv(client->tls, plain + plain_len,
+            plain_size - plain_len);
+        if (n == -1)
+            return -1;
+        if (n == 0)
+            break;
+
+        plain_len += n;
+    }
+
+    if (tls_flush(client->tls, client->stream) == -1)
+        return -1;
+
+    *data = plain;
+    *len = plain_len;
+
+    return 0;
+}
+
+static void read_cb(struct sev_stream *stream, char *data, size_t len)
+{
+    struct mux_client *client = stream->data;
+
+    mux_spin();
+
+    // everything past here, including the capture, sees plaintext
+    if (client->tls) {
+        if (mux_client_decrypt(client, &data, &len) == -1) {
+            client->resumable = 0;
+            sev_close(stream, "tls error");
+            return;
+        }
+
+        if (!client->opened && tls_ready(client->tls))
+            mux_client_start(client);
+
+        if (len == 0)
+            return;
+    }
+
+    if (capturing)
+        mux_capture_write(CAPTURE_READ, client->id, 0, data, len);
+
+    if (client->state == MUX_REJECTED)
+        return;
+
+    // the client may be closed and freed by the time the read is accounted
+    char who[64];
+    snprintf(who, sizeof(who), "%s", client->tag);
+
+    double start = profile_begin();
+
+    mux_client_touch(client);
+    client->listener->protocol->read(client, data, len);
+
+    profile_end(PROFILE_READ, start, who, len);
+}
+
+static void close_cb(struct sev_stream *stream, const char *reason)
+{
+    struct mux_client *client = stream->data;
+
+    char who[64];
+    snprintf(who, sizeof(who), "%s", client->tag ? client->tag : "-");
+
+    if (capturing)
+        mux_capture_write(CAPTURE_CLOSE, client->id, 0, "", 0);
+
+    double start = profile_begin();
+
+    if (client->opened && client->listener->protocol->close)
+        client->listener->protocol->close(client);
+
+    // a dropped connection that can come back is kept for a while
+    if (!client->resumable || !client->attached ||
+            (client->state != MUX_ACTIVE && client->state != MUX_PINGED) ||
+            mux_client_detach(client, reason) == -1)
+        mux_client_close(client, reason);
+
+    profile_end(PROFILE_CLOSE, start, who, 0);
+}
+
+int mux_busypoll(int core, int usecs)
+{
+    // the redis connections are served from the same loop, so pinning the
+    // process pins them too
+    if (core >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(core, &set);
+
+        if (sched_setaffinity(0, sizeof(set), &set) == -1)
+            return -1;
+    }
+
+    if (usecs <= 0)
+        return 0;
+
+    for (int i = 0; i < SHARDS; i++) {
+        queue_busy_poll(&mq_out[i], usecs);
+        inbound_busy_poll(&mq_in[i], usecs);
+    }
+
+    spin_window = usecs / 1e6;
+
+    ev_idle_init(&spin_idle, spin_idle_cb);
+    ev_prepare_init(&spin_watcher, spin_cb);
+    ev_prepare_start(EV_DEFAULT_ &spin_watcher);
+    ev_unref(EV_DEFAULT);
+
+    printf("busypoll core %d spin %dus\n", core, usecs);
+
+    return 0;
+}
+
+void mux_unlimit(void)
+{
+    max_per_ip = UINT32_MAX;
+    ratelimit_on = 0;
+
+    printf("no per-address or rate limits\n");
+}
+
+void mux_read_budget(size_t bytes)
+{
+    read_budget = bytes;
+
+    printf("read budget %zu\n", bytes);
+}
+
+int mux_capture(const char *path)
+{
+    if (capture_open(&capture, path) == -1)
+        return -1;
+
+    capturing = 1;
+    printf("capturing to %s\n", path);
+
+    return 0;
+}
+
+int mux_listen(struct mux_listener *listener,
+    const struct mux_protocol *protocol, int port, struct tls_server *tls)
+{
+    listener->protocol = protocol;
+    listener->port = port;
+    listener->tls = tls;
+    listener->processed = 0;
+    listener->egress = NULL;
+
+    if (sev_listen(&listener->server, port))
+        return -1;
+
+    listener->server.open_cb = open_cb;
+    listener->server.read_cb = read_cb;
+    listener->server.close_cb = close_cb;
 
-    char *mq;
-    asprintf(&mq, "mq:%s", name);
+    // clients the kernel still holds for this listener are gone
+    for (int i = 0; i < SHARDS; i++)
+        queue_pushf(&mq_out[i], LANE_HIGH, "reset %s server restart",
+            protocol->name);
 
-    rmq_init(&mq_in, REDIS_HOST, REDIS_PORT, REDIS_DB, mq);
-    rmq_blpop(&mq_in, blpop_cb);
+    printf("%s started on port %d%s\n", protocol->name, port,
+        tls ? " with tls" : "");
 
-    free(mq);
+    return 0;
 }
@@ -24,28 +24,220 @@
  */
 
 #include <stdlib.h>
+#include <sys/queue.h>
 #include "../sev/sev.h"
 #include "tree.h"
+#include "wheel.h"
+#include "utf8.h"
 
 #define BUFFER_SIZE 1024
 
+// timeouts, in seconds
+#define HANDSHAKE_TIMEOUT 10
+#define PING_INTERVAL 90
+#define PING_TIMEOUT 30
+
+// hex characters in a resume token
+#define MUX_TOKEN_SIZE 32
+
+enum mux_client_state {
+    MUX_REJECTED,
+    MUX_HANDSHAKE,
+    MUX_ACTIVE,
+    MUX_PINGED,
+    MUX_DETACHED,
+};
+
+enum mux_ratelimit_action {
+    RATELIMIT_DELAY,
+    RATELIMIT_DROP,
+    RATELIMIT_DISCONNECT,
+};
+
+// per-client token buckets on ingress lines; a zero rate disables a bucket
+struct mux_ratelimit {
+    double lines;
+    double bytes;
+    double burst;
+    int action;
+};
+
+struct mux_client;
+
+// per-connection bits kept next to the stream in the registry's slots, so
+// a broadcast can send without touching the client; bits from
+// MUX_FLAG_PROTOCOL up belong to the protocol, set before it is attached
+#define MUX_FLAG_DETACHED 0x01
+#define MUX_FLAG_TLS 0x02
+#define MUX_FLAG_PROTOCOL 0x10
+
+// protocol behaviour; hooks marked optional may be NULL
+struct mux_protocol {
+    const char *name;
+    int port;
+
+    struct mux_ratelimit ratelimit;
+    int utf8_ingress;
+
+    // seconds a dropped client that asked for a resume token is kept
+    // alive, buffering egress, before the kernel sees it disconnect; when
+    // set, the connect is only pushed once mux_client_resume() is called
+    double resume;
+
+    // once at startup, before any listener is opened (optional)
+    void (*init)(void);
+
+    // stream events, for clients that were admitted (open and close are
+    // optional)
+    void (*open)(struct mux_client *);
+    void (*read)(struct mux_client *, char *data, size_t len);
+    void (*close)(struct mux_client *);
+
+    // ingress line or message seen before it is pushed; returns nonzero
+    // if it was handled locally (optional)
+    int (*client_message)(struct mux_client *, char *line, size_t len);
+
+    // egress message, once per listener, before it is fanned out to that
+    // listener's clients; returns what is passed on to this protocol's
+    // server_message and server_broadcast, which may be in a form of the
+    // protocol's own, and updates its length, which covers any NUL bytes of
+    // binary messages; NULL sends the message to nobody (optional)
+    char *(*process_message)(char *message, size_t *len);
+
+    void (*server_message)(struct mux_client *, char *message, size_t len);
+
+    // server_message() for a broadcast, given only the stream and its slot
+    // flags; not used for tls streams (optional)
+    void (*server_broadcast)(struct sev_stream *, int flags, char *message,
+        size_t len);
+    void (*server_close)(struct mux_client *);
+    void (*server_ping)(struct mux_client *);    // optional
+    void (*server_token)(struct mux_client *, const char *token);
+
+    // close with a websocket status code; also called from inside read(),
+    // when input is refused or floods, so a protocol whose parser can't be
+    // freed there has to hold the close until it is done
+    void (*server_error)(struct mux_client *, int code, const char *reason);
+};
+
+struct mux_listener {
+    // first, so that a stream's server is its listener
+    struct sev_server server;
+    const struct mux_protocol *protocol;
+    int port;
+
+    // userspace tls on every connection, or NULL for plaintext
+    struct tls_server *tls;
+
+    // the inbound message last processed for this listener, and the result
+    uint64_t processed;
+    char *egress;
+    size_t egress_len;
+};
+
 struct mux_client {
     char *tag;
+    uint32_t id;
 
+    struct mux_listener *listener;
     struct sev_stream *stream;
+    struct tls *tls;
+    struct queue *queue;
     void *data;
 
+    // the protocol has seen the open: at once on plaintext listeners, and
+    // once the handshake is done on tls ones
+    int opened;
+
+    // announced to the kernel and in the registry
+    int attached;
+    unsigned char flags;
+
+    int resumable;
+    char token[MUX_TOKEN_SIZE + 1];
+    struct mux_replay *replay;
+
     char buffer[BUFFER_SIZE];
     size_t buffer_len;
     int buffer_start;
 
+    int state;
+    ev_tstamp last_active;
+    struct wheel_timer timer;
+
+    double line_tokens;
+    double byte_tokens;
+    ev_tstamp refill;
+    int throttled;
+    char *backlog;
+    size_t backlog_len;
+    struct wheel_timer throttle;
+
+    // bytes left to process in this loop iteration; the rest waits in
+    // the backlog on the deferred list
+    size_t budget;
+    unsigned int budget_epoch;
+    int deferred;
+    TAILQ_ENTRY(mux_client) deferred_entry;
+
+    // index into the dense array of attached clients
+    size_t slot;
+
     RB_ENTRY(mux_client) entry;
+    RB_ENTRY(mux_client) token_entry;
 };
 
-struct mux_client *mux_client_open(struct sev_stream *stream);
+// an attached client in the registry's dense array: what a full sweep
+// needs sits in one array instead of behind each client's pointer and line
+// buffer
+struct mux_slot {
+    struct sev_stream *stream;
+    struct mux_listener *listener;
+    struct mux_client *client;
+    unsigned char flags;
+};
 
+// ingress bytes, split into lines; a client that floods or sends invalid
+// input is closed through server_error()
 void mux_client_data(struct mux_client *client, char *data, size_t len);
 
-void mux_client_close(struct mux_client *client, const char *reason);
+
+// a complete message, pushed as one event instead of being split into
+// lines; returns -1 if the client was closed, through server_error()
+int mux_client_message(struct mux_client *client, int binary, char *data,
+    size_t len);
+
+// announce the client; a NULL token opts out of resumption, an empty or
+// unknown one starts a new session, and a known one takes over that
+// session and replays what it missed
+void mux_client_resume(struct mux_client *client, const char *token);
+
+// sev_send(), through the client's tls session if it has one
+int mux_send(struct mux_client *client, const char *data, size_t len);
+
+void mux_client_touch(struct mux_client *client);
+
+void mux_client_state(struct mux_client *client, int state);
+
+void mux_timer_add(struct wheel_timer *timer, double seconds);
 
 void mux_init(void);
+
+// low latency mode, after mux_init(): pin the process to a core (-1 leaves
+// it unpinned), and for usecs after each event keep polling instead of
+// sleeping, with kernel busy-polling on the redis sockets
+int mux_busypoll(int core, int usecs);
+
+// for benchmarks that connect every client from one address, after
+// mux_init(): no cap on clients per address, and no rate limits
+void mux_unlimit(void);
+
+// bytes of lines read per client per loop iteration; 0 turns the budget off
+void mux_read_budget(size_t bytes);
+
+// record all ingress and egress to a capture file, for replay
+int mux_capture(const char *path);
+
+// tls is NULL for a plaintext listener
+int mux_listen(struct mux_listener *listener,
+    const struct mux_protocol *protocol, int port, struct tls_server *tls);
@@ -0,0 +1,145 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ev.h>
+#include "profile.h"
+
+static const char *names[PROFILE_CALLBACKS] = {
+    "open", "read", "close", "blpop", "timers", "replay",
+};
+
+static struct {
+    uint64_t calls;
+    double time;
+    double max;
+} totals[PROFILE_CALLBACKS];
+
+// the slowest callback of the current iteration
+static struct {
+    int callback;
+    double time;
+    char who[64];
+    size_t size;
+} slowest;
+
+static ev_check check_watcher;
+static ev_prepare prepare_watcher;
+static double iteration_start;
+
+static uint64_t stalls;
+static double stall_max;
+
+// check watchers run right after polling, prepare watchers right before
+// the next poll, so the time between them is the work of one iteration
+static void check_cb(EV_P_ ev_check *watcher, int revents)
+{
+    iteration_start = ev_time();
+    slowest.time = 0;
+}
+
+static void prepare_cb(EV_P_ ev_prepare *watcher, int revents)
+{
+    if (iteration_start == 0)
+        return;
+
+    double busy = ev_time() - iteration_start;
+    iteration_start = 0;
+
+    if (busy < PROFILE_STALL)
+        return;
+
+    stalls++;
+    if (busy > stall_max)
+        stall_max = busy;
+
+    if (slowest.time == 0) {
+        printf("stall %.3fs outside of profiled callbacks\n", busy);
+        return;
+    }
+
+    printf("stall %.3fs %s %s %zu bytes %.3fs\n", busy,
+        names[slowest.callback], slowest.who, slowest.size, slowest.time);
+}
+
+void profile_init(void)
+{
+    ev_check_init(&check_watcher, check_cb);
+    ev_set_priority(&check_watcher, EV_MAXPRI);
+    ev_check_start(EV_DEFAULT_ &check_watcher);
+
+    ev_prepare_init(&prepare_watcher, prepare_cb);
+    ev_set_priority(&prepare_watcher, EV_MINPRI);
+    ev_prepare_start(EV_DEFAULT_ &prepare_watcher);
+
+    // neither watcher should keep the loop alive by itself
+    ev_unref(EV_DEFAULT);
+    ev_unref(EV_DEFAULT);
+}
+
+double profile_begin(void)
+{
+    return ev_time();
+}
+
+void profile_end(int callback, double start, const char *who, size_t size)
+{
+    double elapsed = ev_time() - start;
+
+    totals[callback].calls++;
+    totals[callback].time += elapsed;
+    if (elapsed > totals[callback].max)
+        totals[callback].max = elapsed;
+
+    if (elapsed <= slowest.time)
+        return;
+
+    slowest.callback = callback;
+    slowest.time = elapsed;
+    slowest.size = size;
+    snprintf(slowest.who, sizeof(slowest.who), "%s", who ? who : "-");
+}
+
+void profile_stats(void)
+{
+    for (int i = 0; i < PROFILE_CALLBACKS; i++) {
+        if (totals[i].calls == 0)
+            continue;
+
+        printf("stats profile %s calls %llu time %.3fs max %.3fs\n",
+            names[i], (unsigned long long)totals[i].calls, totals[i].time,
+            totals[i].max);
+    }
+
+    if (stalls)
+        printf("stats stalls %llu max %.3fs\n", (unsigned long long)stalls,
+            stall_max);
+
+    memset(totals, 0, sizeof(totals));
+    stalls = 0;
+    stall_max = 0;
+}
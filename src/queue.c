@@ -0,0 +1,317 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// for asprintf and vasprintf
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "../sev/sev.h"
+#include "../hiredis/adapters/libev.h"
+#include "queue.h"
+#include "profile.h"
+
+static void queue_connect(struct queue *queue);
+
+static void queue_replay_cb(redisAsyncContext *redis, void *reply,
+    void *privdata);
+
+static void queue_replay(struct queue *queue)
+{
+    const char *argv[2 + QUEUE_BATCH];
+    size_t argvlen[2 + QUEUE_BATCH];
+
+    size_t count = spool_read(&queue->spool, argv + 2, argvlen + 2,
+        QUEUE_BATCH);
+    if (count == 0)
+        return;
+
+    // each record starts with its lane; a batch stops where the lane
+    // changes, so events reach each list in the order they were pushed
+    int lane = argv[2][0];
+
+    argv[0] = "RPUSH";
+    argvlen[0] = 5;
+    argv[1] = queue->keys[lane];
+    argvlen[1] = strlen(argv[1]);
+
+    size_t n = 0;
+    for (; n < count && argv[2 + n][0] == lane; n++) {
+        argv[2 + n]++;
+        argvlen[2 + n]--;
+    }
+    count = n;
+
+    // records are only consumed once redis acknowledges the batch
+    queue->replaying = 1;
+    redisAsyncCommandArgv(queue->redis, queue_replay_cb,
+        (void *)(uintptr_t)count, 2 + count, argv, argvlen);
+}
+
+static void queue_replay_cb(redisAsyncContext *redis, void *reply,
+    void *privdata)
+{
+    struct queue *queue = redis->data;
+    size_t count = (uintptr_t)privdata;
+
+    queue->replaying = 0;
+
+    if (reply == NULL || ((redisReply *)reply)->type == REDIS_REPLY_ERROR)
+        return;
+
+    double start = profile_begin();
+
+    spool_consume(&queue->spool, count);
+    queue->replayed += count;
+
+    if (queue->connected)
+        queue_replay(queue);
+
+    profile_end(PROFILE_REPLAY, start, queue->keys[LANE_NORMAL], count);
+}
+
+static void queue_connect_cb(const redisAsyncContext *redis, int status)
+{
+    struct queue *queue = redis->data;
+
+    if (status != REDIS_OK) {
+        printf("redis %s:%d connect error: %s\n", queue->host, queue->port,
+            redis->errstr);
+        queue->redis = NULL;
+        ev_timer_start(EV_DEFAULT_ &queue->reconnect);
+        return;
+    }
+
+    printf("redis %s:%d connected\n", queue->host, queue->port);
+    queue->connected = 1;
+
+    if (spool_depth(&queue->spool))
+        printf("replaying %zu spooled events\n", spool_depth(&queue->spool));
+
+    queue_replay(queue);
+}
+
+static void queue_disconnect_cb(const redisAsyncContext *redis, int status)
+{
+    struct queue *queue = redis->data;
+
+    printf("redis %s:%d disconnected\n", queue->host, queue->port);
+    queue->redis = NULL;
+    queue->connected = 0;
+    queue->replaying = 0;
+    ev_timer_start(EV_DEFAULT_ &queue->reconnect);
+}
+
+static void queue_reconnect_cb(EV_P_ ev_timer *watcher, int revents)
+{
+    struct queue *queue = watcher->data;
+
+    ev_timer_stop(EV_A_ watcher);
+    queue_connect(queue);
+}
+
+static void queue_connect(struct queue *queue)
+{
+    redisAsyncContext *redis = redisAsyncConnect(queue->host, queue->port);
+
+    if (redis->err) {
+        printf("redis %s:%d error: %s\n", queue->host, queue->port,
+            redis->errstr);
+        redisAsyncFree(redis);
+        ev_timer_start(EV_DEFAULT_ &queue->reconnect);
+        return;
+    }
+
+    redis->data = queue;
+    queue->redis = redis;
+    queue_busy_poll(queue, queue->busy_poll);
+
+    redisLibevAttach(EV_DEFAULT_ redis);
+    redisAsyncSetConnectCallback(redis, queue_connect_cb);
+    redisAsyncSetDisconnectCallback(redis, queue_disconnect_cb);
+    redisAsyncCommand(redis, NULL, NULL, "SELECT %d", queue->db);
+}
+
+void queue_keys(struct queue *queue, const char *key)
+{
+    queue->keys[LANE_NORMAL] = strdup(key);
+    asprintf(&queue->keys[LANE_HIGH], "%s:high", key);
+
+    for (int lane = 0; lane < LANES; lane++)
+        queue->header_len[lane] = asprintf(&queue->header[lane],
+            "*3\r\n$5\r\nRPUSH\r\n$%zu\r\n%s\r\n",
+            strlen(queue->keys[lane]), queue->keys[lane]);
+}
+
+void queue_init(struct queue *queue, const char *host, int port, int db,
+    const char *key, const char *spool_path)
+{
+    *queue = (struct queue) {
+        .host = strdup(host),
+        .port = port,
+        .db = db,
+    };
+
+    queue_keys(queue, key);
+
+    if (spool_init(&queue->spool, spool_path) == -1)
+        perror("spool_init");
+
+    ev_timer_init(&queue->reconnect, queue_reconnect_cb, QUEUE_RECONNECT, 0);
+    queue->reconnect.data = queue;
+
+    queue_connect(queue);
+}
+
+static size_t queue_itoa(char *p, size_t n)
+{
+    char digits[20];
+    size_t len = 0;
+
+    do {
+        digits[len++] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+
+    for (size_t i = 0; i < len; i++)
+        p[i] = digits[len - 1 - i];
+
+    return len;
+}
+
+size_t queue_format(struct queue *queue, int lane, const char *prefix,
+    size_t prefix_len, const char *data, size_t len)
+{
+    size_t value_len = prefix_len + len;
+    size_t need = queue->header_len[lane] + 24 + value_len;
+
+    if (need > queue->command_size) {
+        queue->command_size = 2 * need;
+        queue->command = realloc(queue->command, queue->command_size);
+    }
+
+    char *p = queue->command;
+
+    memcpy(p, queue->header[lane], queue->header_len[lane]);
+    p += queue->header_len[lane];
+
+    *p++ = '$';
+    p += queue_itoa(p, value_len);
+    *p++ = '\r';
+    *p++ = '\n';
+
+    memcpy(p, prefix, prefix_len);
+    p += prefix_len;
+    memcpy(p, data, len);
+    p += len;
+
+    *p++ = '\r';
+    *p++ = '\n';
+
+    return p - queue->command;
+}
+
+static void queue_rpush(struct queue *queue, int lane, const char *prefix,
+    size_t prefix_len, const char *data, size_t len)
+{
+    size_t n = queue_format(queue, lane, prefix, prefix_len, data, len);
+    redisAsyncFormattedCommand(queue->redis, NULL, NULL, queue->command, n);
+}
+
+void queue_pushv(struct queue *queue, int lane, const char *prefix,
+    size_t prefix_len, const char *data, size_t len)
+{
+    queue->pushed[lane]++;
+
+    // keep events in order: while anything is spooled, new ones queue up
+    // behind it
+    if (queue->connected && spool_depth(&queue->spool) == 0) {
+        queue_rpush(queue, lane, prefix, prefix_len, data, len);
+        return;
+    }
+
+    // spooled as <lane><prefix><data>
+    char *record = malloc(1 + prefix_len + len);
+    record[0] = lane;
+    if (prefix_len)
+        memcpy(record + 1, prefix, prefix_len);
+    memcpy(record + 1 + prefix_len, data, len);
+    int ret = spool_push(&queue->spool, record, 1 + prefix_len + len);
+    free(record);
+
+    if (ret == -1)
+        return;
+
+    if (queue->connected && !queue->replaying)
+        queue_replay(queue);
+}
+
+void queue_push(struct queue *queue, const char *data, size_t len)
+{
+    queue_pushv(queue, LANE_NORMAL, NULL, 0, data, len);
+}
+
+void queue_pushf(struct queue *queue, int lane, const char *format, ...)
+{
+    char *data;
+    va_list args;
+
+    va_start(args, format);
+    int len = vasprintf(&data, format, args);
+    va_end(args);
+
+    if (len == -1)
+        return;
+
+    queue_pushv(queue, lane, NULL, 0, data, len);
+    free(data);
+}
+
+static void queue_llen_cb(redisAsyncContext *redis, void *reply,
+    void *privdata)
+{
+    long long *len = privdata;
+
+    if (reply && ((redisReply *)reply)->type == REDIS_REPLY_INTEGER)
+        *len = ((redisReply *)reply)->integer;
+}
+
+void queue_busy_poll(struct queue *queue, int usecs)
+{
+    queue->busy_poll = usecs;
+
+    if (usecs && queue->redis && setsockopt(queue->redis->c.fd, SOL_SOCKET,
+            SO_BUSY_POLL, &usecs, sizeof(usecs)) == -1)
+        perror("SO_BUSY_POLL");
+}
+
+void queue_llen(struct queue *queue, const char *key, long long *len)
+{
+    if (queue->connected)
+        redisAsyncCommand(queue->redis, queue_llen_cb, len, "LLEN %s", key);
+}
@@ -0,0 +1,91 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <ev.h>
+#include "../hiredis/async.h"
+#include "spool.h"
+
+#define QUEUE_RECONNECT 1.0
+#define QUEUE_BATCH 256
+
+// each list has a "<key>:high" companion for events that must not wait
+// behind bulk traffic
+enum lane {
+    LANE_NORMAL,
+    LANE_HIGH,
+    LANES,
+};
+
+// outbound redis list, spooling locally while redis is unreachable
+struct queue {
+    char *host;
+    int port;
+    int db;
+    char *keys[LANES];
+
+    // RPUSH commands are encoded by hand: the start of the command is
+    // fixed per lane, and the rest is written into a reusable buffer
+    char *header[LANES];
+    size_t header_len[LANES];
+    char *command;
+    size_t command_size;
+
+    redisAsyncContext *redis;
+    int busy_poll;
+    int connected;
+    int replaying;
+    ev_timer reconnect;
+
+    struct spool spool;
+    uint64_t replayed;
+    uint64_t pushed[LANES];
+};
+
+void queue_init(struct queue *queue, const char *host, int port, int db,
+    const char *key, const char *spool_path);
+
+// set the lists and command headers only, as queue_init() does
+void queue_keys(struct queue *queue, const char *key);
+
+// encode RPUSH <key> <prefix><data> in resp into queue->command, without
+// going through hiredis' format parser; returns its length
+size_t queue_format(struct queue *queue, int lane, const char *prefix,
+    size_t prefix_len, const char *data, size_t len);
+
+void queue_push(struct queue *queue, const char *data, size_t len);
+
+// push prefix and data as a single element, without joining them first
+void queue_pushv(struct queue *queue, int lane, const char *prefix,
+    size_t prefix_len, const char *data, size_t len);
+
+void queue_pushf(struct queue *queue, int lane, const char *format, ...);
+
+// have the kernel busy-poll the redis socket for up to usecs on reads,
+// now and after every reconnect; 0 turns it off for new connections
+void queue_busy_poll(struct queue *queue, int usecs);
+
+// store the length of a list on the queue's connection in *len, once
+// redis replies
+void queue_llen(struct queue *queue, const char *key, long long *len);
@@ -0,0 +1,520 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// for clock_gettime and getopt
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../hiredis/hiredis.h"
+#include "capture.h"
+#include "trace.h"
+
+// must match mux.c and queue.h
+#define REDIS_DB 7
+#define INBOUND "mq:mux"
+#define KERNEL "mq:kernel"
+#define LANE_HIGH 1
+
+// redis commands in flight before their replies are read
+#define PIPELINE 256
+
+// seconds to keep reading after the last record, for egress to drain
+#define DRAIN 1.0
+
+// a replayed connection, indexed by its stream id in the capture
+struct conn {
+    int fd;
+    char *tag;
+    char *new_tag;
+
+    // times at which egress for this connection was pushed, not yet seen
+    double *pending;
+    size_t pending_len;
+    size_t pending_size;
+};
+
+static struct conn *conns;
+static size_t conns_size;
+
+// capture tag -> stream id, open addressing
+static uint32_t *tags;
+static size_t tags_size;
+static size_t tags_used;
+
+static redisContext *redis;
+static int in_flight;
+
+static const char *mux_host = "127.0.0.1";
+static int fast;
+
+static struct trace_histogram latency;
+static uint64_t records, connections, egress;
+static uint64_t bytes_sent, bytes_received;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t tag_hash(const char *tag, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)tag[i]) * 1099511628211ULL;
+
+    return hash;
+}
+
+static uint32_t *tag_slot(const char *tag, size_t len)
+{
+    size_t mask = tags_size - 1;
+    size_t i = tag_hash(tag, len) & mask;
+
+    for (; tags[i]; i = (i + 1) & mask) {
+        const char *t = conns[tags[i]].tag;
+        if (strlen(t) == len && !memcmp(t, tag, len))
+            break;
+    }
+
+    return &tags[i];
+}
+
+static void tag_add(uint32_t stream)
+{
+    if (2 * (tags_used + 1) > tags_size) {
+        uint32_t *old = tags;
+        size_t old_size = tags_size;
+
+        tags_size = tags_size ? 2 * tags_size : 1024;
+        tags = calloc(tags_size, sizeof(uint32_t));
+
+        for (size_t i = 0; i < old_size; i++)
+            if (old[i]) {
+                const char *t = conns[old[i]].tag;
+                *tag_slot(t, strlen(t)) = old[i];
+            }
+
+        free(old);
+    }
+
+    const char *tag = conns[stream].tag;
+    uint32_t *slot = tag_slot(tag, strlen(tag));
+    if (*slot == 0)
+        tags_used++;
+    *slot = stream;
+}
+
+static struct conn *conn_get(uint32_t stream)
+{
+    if (stream >= conns_size) {
+        size_t size = conns_size ? conns_size : 1024;
+        while (size <= stream)
+            size *= 2;
+
+        conns = realloc(conns, size * sizeof(struct conn));
+        memset(conns + conns_size, 0, (size - conns_size) * sizeof(struct conn));
+        for (size_t i = conns_size; i < size; i++)
+            conns[i].fd = -1;
+        conns_size = size;
+    }
+
+    return &conns[stream];
+}
+
+static void conn_close(struct conn *conn)
+{
+    if (conn->fd == -1)
+        return;
+
+    close(conn->fd);
+    conn->fd = -1;
+    conn->pending_len = 0;
+}
+
+static void conn_read(struct conn *conn)
+{
+    char buffer[65536];
+    ssize_t n = recv(conn->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+
+    if (n <= 0) {
+        conn_close(conn);
+        return;
+    }
+
+    bytes_received += n;
+
+    // everything pushed before this read has started arriving
+    double t = now();
+    for (size_t i = 0; i < conn->pending_len; i++)
+        trace_record(&latency, t - conn->pending[i]);
+    conn->pending_len = 0;
+}
+
+static void redis_flush(void)
+{
+    for (; in_flight; in_flight--) {
+        void *reply;
+        if (redisGetReply(redis, &reply) != REDIS_OK) {
+            fprintf(stderr, "redis: %s\n", redis->errstr);
+            exit(1);
+        }
+        freeReplyObject(reply);
+    }
+}
+
+// read from every open connection until the deadline; a deadline in the
+// past polls once
+static void pump(double deadline)
+{
+    static struct pollfd *fds;
+    static uint32_t *ids;
+    static size_t size;
+
+    redis_flush();
+
+    do {
+        if (size < conns_size) {
+            size = conns_size;
+            fds = realloc(fds, size * sizeof(struct pollfd));
+            ids = realloc(ids, size * sizeof(uint32_t));
+        }
+
+        nfds_t n = 0;
+        for (uint32_t i = 0; i < conns_size; i++) {
+            if (conns[i].fd == -1)
+                continue;
+
+            fds[n] = (struct pollfd) { .fd = conns[i].fd, .events = POLLIN };
+            ids[n++] = i;
+        }
+
+        double wait = deadline - now();
+        int timeout = wait > 0 ? wait * 1000 : 0;
+
+        if (poll(fds, n, timeout) <= 0)
+            continue;
+
+        for (nfds_t i = 0; i < n; i++)
+            if (fds[i].revents)
+                conn_read(&conns[ids[i]]);
+    } while (now() < deadline);
+}
+
+static void replay_open(struct capture_record *record)
+{
+    struct conn *conn = conn_get(record->stream);
+    const char *tag = (const char *)(record + 1);
+
+    conn_close(conn);
+    free(conn->tag);
+    free(conn->new_tag);
+    conn->tag = strndup(tag, record->len);
+    conn->new_tag = NULL;
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(record->port),
+    };
+    inet_pton(AF_INET, mux_host, &addr.sin_addr);
+
+    conn->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(conn->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("connect");
+        conn_close(conn);
+        return;
+    }
+
+    connections++;
+
+    // rejected clients have no tag, and never receive egress
+    if (record->len == 0)
+        return;
+
+    // the mux will know this connection by its own address and port
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+    getsockname(conn->fd, (struct sockaddr *)&local, &len);
+
+    char address[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &local.sin_addr, address, sizeof(address));
+
+    const char *colon = memchr(tag, ':', record->len);
+    int protocol_len = colon ? colon - tag : 0;
+
+    asprintf(&conn->new_tag, "%.*s:%s-%d", protocol_len, tag, address,
+        ntohs(local.sin_port));
+    tag_add(record->stream);
+}
+
+static void replay_read(struct capture_record *record)
+{
+    struct conn *conn = conn_get(record->stream);
+    const char *data = (const char *)(record + 1);
+    size_t len = record->len;
+
+    while (len && conn->fd != -1) {
+        ssize_t n = send(conn->fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if (n == -1 && errno == EAGAIN) {
+            // the mux isn't reading this client; let it catch up
+            pump(now() + 0.001);
+            continue;
+        }
+
+        if (n == -1) {
+            conn_close(conn);
+            return;
+        }
+
+        data += n;
+        len -= n;
+        bytes_sent += n;
+    }
+}
+
+static void replay_egress(struct capture_record *record)
+{
+    const char *reply = (const char *)(record + 1);
+    const char *end = reply + record->len;
+
+    // drop a latency stamp left by a tracing mux
+    if (*reply == '@') {
+        const char *space = memchr(reply, ' ', end - reply);
+        reply = space ? space + 1 : end;
+    }
+
+    const char *message = memchr(reply, ' ', end - reply);
+    if (message == NULL)
+        return;
+
+    // rewrite the recipients to the tags of the replayed connections;
+    // unknown ones are kept, so the mux still looks them up
+    size_t size = 2 * (end - reply) + 64;
+    char *out = malloc(size);
+    size_t out_len = 0;
+    double t = now();
+
+    for (const char *tag = reply; tag < message; ) {
+        const char *comma = memchr(tag, ',', message - tag);
+        size_t len = (comma ? comma : message) - tag;
+
+        uint32_t stream = tags_size ? *tag_slot(tag, len) : 0;
+        struct conn *conn = stream ? &conns[stream] : NULL;
+        const char *new_tag = conn ? conn->new_tag : tag;
+        size_t new_len = conn ? strlen(new_tag) : len;
+
+        if (out_len + new_len + 1 + (end - message) > size) {
+            size = 2 * size + new_len;
+            out = realloc(out, size);
+        }
+
+        if (out_len)
+            out[out_len++] = ',';
+        memcpy(out + out_len, new_tag, new_len);
+        out_len += new_len;
+
+        if (conn && conn->fd != -1) {
+            if (conn->pending_len == conn->pending_size) {
+                conn->pending_size = conn->pending_size ?
+                    2 * conn->pending_size : 16;
+                conn->pending = realloc(conn->pending,
+                    conn->pending_size * sizeof(double));
+            }
+            conn->pending[conn->pending_len++] = t;
+        }
+
+        tag += len + 1;
+    }
+
+    memcpy(out + out_len, message, end - message);
+    out_len += end - message;
+
+    // egress records keep the lane in the port field
+    redisAppendCommand(redis, "RPUSH %s %b",
+        record->port == LANE_HIGH ? INBOUND ":high" : INBOUND, out, out_len);
+    free(out);
+
+    egress++;
+    if (++in_flight >= PIPELINE)
+        redis_flush();
+}
+
+static long long redis_integer(const char *command)
+{
+    redisReply *reply = redisCommand(redis, command);
+    long long n = reply && reply->type == REDIS_REPLY_INTEGER ?
+        reply->integer : 0;
+
+    freeReplyObject(reply);
+    return n;
+}
+
+// usage: replay [-c] [-f] [-m mux host] [-h redis host] [-p redis port]
+//     capture
+//
+// the queues are the mux's own, in its database, so they are only emptied
+// before and after the run with -c; without it, replay will not start on
+// queues that already hold messages
+int main(int argc, char *argv[])
+{
+    const char *redis_host = "127.0.0.1";
+    int redis_port = 6379;
+    int clear = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "cfm:h:p:")) != -1) {
+        switch (opt) {
+        case 'c':
+            clear = 1;
+            break;
+
+        case 'f':
+            fast = 1;
+            break;
+
+        case 'm':
+            mux_host = optarg;
+            break;
+
+        case 'h':
+            redis_host = optarg;
+            break;
+
+        case 'p':
+            redis_port = atoi(optarg);
+            break;
+
+        default:
+            optind = argc;
+            break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-c] [-f] [-m mux host] [-h redis host] "
+            "[-p redis port] capture\n", argv[0]);
+        return -1;
+    }
+
+    struct capture capture;
+    if (capture_map(&capture, argv[optind]) == -1) {
+        perror("capture");
+        return -1;
+    }
+
+    redis = redisConnect(redis_host, redis_port);
+    if (redis == NULL || redis->err) {
+        fprintf(stderr, "redis: %s\n", redis ? redis->errstr : "no memory");
+        return -1;
+    }
+
+    freeReplyObject(redisCommand(redis, "SELECT %d", REDIS_DB));
+
+    if (clear) {
+        freeReplyObject(redisCommand(redis, "DEL " INBOUND " " INBOUND
+            ":high " KERNEL " " KERNEL ":high"));
+    }
+    else if (redis_integer("LLEN " INBOUND) +
+            redis_integer("LLEN " INBOUND ":high") +
+            redis_integer("LLEN " KERNEL) +
+            redis_integer("LLEN " KERNEL ":high")) {
+        fprintf(stderr, "redis db %d: the " INBOUND " and " KERNEL " queues "
+            "are not empty; run with -c to clear them\n", REDIS_DB);
+        return -1;
+    }
+
+    double start = now();
+    double first = 0;
+    size_t pos = 0;
+    struct capture_record *record;
+
+    while ((record = capture_next(&capture, &pos)) != NULL) {
+        if (first == 0)
+            first = record->time;
+
+        // at recorded speed, read from the mux while waiting for the next
+        // record; as fast as possible, only every so often
+        if (!fast)
+            pump(start + (record->time - first));
+        else if (records % PIPELINE == 0)
+            pump(0);
+
+        switch (record->type) {
+        case CAPTURE_OPEN:
+            replay_open(record);
+            break;
+
+        case CAPTURE_READ:
+            replay_read(record);
+            break;
+
+        case CAPTURE_CLOSE:
+            conn_close(conn_get(record->stream));
+            break;
+
+        case CAPTURE_EGRESS:
+            replay_egress(record);
+            break;
+        }
+
+        records++;
+    }
+
+    double elapsed = now() - start;
+    pump(now() + DRAIN);
+
+    long long events = redis_integer("LLEN " KERNEL) +
+        redis_integer("LLEN " KERNEL ":high");
+    if (clear)
+        freeReplyObject(redisCommand(redis, "DEL " KERNEL " " KERNEL ":high"));
+
+    printf("records %llu in %.3fs (%.0f/s)\n", (unsigned long long)records,
+        elapsed, records / elapsed);
+    printf("connections %llu\n", (unsigned long long)connections);
+    printf("ingress %llu bytes (%.0f/s), %lld kernel events\n",
+        (unsigned long long)bytes_sent, bytes_sent / elapsed, events);
+    printf("egress %llu messages (%.0f/s), %llu bytes received\n",
+        (unsigned long long)egress, egress / elapsed,
+        (unsigned long long)bytes_received);
+    printf("latency p50 %.6f p99 %.6f max %.6f (%llu deliveries)\n",
+        trace_quantile(&latency, 0.5), trace_quantile(&latency, 0.99),
+        latency.max, (unsigned long long)latency.count);
+
+    return 0;
+}
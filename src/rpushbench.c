@@ -0,0 +1,102 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// for clock_gettime
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "queue.h"
+
+// RPUSH encoding: queue_format() against hiredis' format parser, which
+// the queue used before, for the sizes of typical kernel events
+#define ITERATIONS 1000000
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// usage: rpushbench [iterations]
+int main(int argc, char *argv[])
+{
+    long iterations = argc > 1 ? atol(argv[1]) : ITERATIONS;
+    static const size_t sizes[] = { 16, 128, 1024, 16384 };
+
+    struct queue queue = { 0 };
+    queue_keys(&queue, "mq:kernel");
+
+    const char *prefix = "message tcpmux:127.0.0.1-40000 ";
+    size_t prefix_len = strlen(prefix);
+
+    char *data = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+    memset(data, 'x', sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+
+    size_t sink = 0;
+
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        size_t len = sizes[i];
+
+        // both must produce the same command
+        char *command;
+        int command_len = redisFormatCommand(&command, "RPUSH %s %b%b",
+            queue.keys[LANE_NORMAL], prefix, prefix_len, data, len);
+        size_t n = queue_format(&queue, LANE_NORMAL, prefix, prefix_len,
+            data, len);
+
+        if (n != command_len || memcmp(queue.command, command, n)) {
+            fprintf(stderr, "encodings differ at %zu bytes\n", len);
+            return -1;
+        }
+        redisFreeCommand(command);
+
+        double start = now();
+        for (long j = 0; j < iterations; j++) {
+            command_len = redisFormatCommand(&command, "RPUSH %s %b%b",
+                queue.keys[LANE_NORMAL], prefix, prefix_len, data, len);
+            sink += command[command_len - 1];
+            redisFreeCommand(command);
+        }
+        double hiredis = (now() - start) / iterations;
+
+        start = now();
+        for (long j = 0; j < iterations; j++) {
+            n = queue_format(&queue, LANE_NORMAL, prefix, prefix_len, data,
+                len);
+            sink += queue.command[n - 1];
+        }
+        double format = (now() - start) / iterations;
+
+        printf("%6zu bytes: hiredis %.1fns queue_format %.1fns (%.1fx)\n",
+            len, hiredis * 1e9, format * 1e9, hiredis / format);
+    }
+
+    // keep the loops from being optimized out
+    return sink == 0;
+}
@@ -0,0 +1,174 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// for getopt
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "capture.h"
+
+// writes a synthetic capture for replay: light clients that chat and
+// receive egress, next to heavy senders that paste as fast as they can.
+// replay's egress latency is what the light clients see of the loop
+
+// one step of the generated timeline, in seconds
+#define TICK 0.001
+
+// heavy senders write this many bytes per read: 655 lines of 100 bytes
+#define HEAVY_CHUNK 65500
+
+static struct capture capture;
+
+// the tag a client would have had in the captured mux
+static int client_tag(char *out, size_t size, int i)
+{
+    return snprintf(out, size, "tcpmux:10.%d.%d.%d-%d", i >> 16 & 0xff,
+        i >> 8 & 0xff, i & 0xff, 40000 + i % 20000);
+}
+
+static void record(double time, int type, uint32_t stream, int port,
+    const char *data, size_t len)
+{
+    if (capture_write(&capture, time, type, stream, port, data, len) == -1) {
+        fprintf(stderr, "capture full\n");
+        exit(1);
+    }
+}
+
+// usage: scenario [-l light] [-H heavy] [-d seconds] [-r egress/s]
+//                 [-b heavy bytes/s] [-p port] capture
+int main(int argc, char *argv[])
+{
+    int light = 1000;
+    int heavy = 0;
+    double duration = 10;
+    double egress_rate = 1000;
+    double heavy_rate = 1 << 20;
+    int port = 5555;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:H:d:r:b:p:")) != -1) {
+        switch (opt) {
+        case 'l':
+            light = atoi(optarg);
+            break;
+
+        case 'H':
+            heavy = atoi(optarg);
+            break;
+
+        case 'd':
+            duration = atof(optarg);
+            break;
+
+        case 'r':
+            egress_rate = atof(optarg);
+            break;
+
+        case 'b':
+            heavy_rate = atof(optarg);
+            break;
+
+        case 'p':
+            port = atoi(optarg);
+            break;
+
+        default:
+            optind = argc;
+            break;
+        }
+    }
+
+    if (optind != argc - 1 || light < 1) {
+        fprintf(stderr, "usage: %s [-l light] [-H heavy] [-d seconds] "
+            "[-r egress/s] [-b heavy bytes/s] [-p port] capture\n", argv[0]);
+        return -1;
+    }
+
+    if (capture_open(&capture, argv[optind]) == -1) {
+        perror("capture");
+        return -1;
+    }
+
+    // stream ids start at 1: light clients first, then heavy ones; a zero
+    // time would end the capture, so everyone connects on the first tick
+    int clients = light + heavy;
+    char tag[64];
+
+    for (int i = 1; i <= clients; i++) {
+        int len = client_tag(tag, sizeof(tag), i);
+        record(TICK, CAPTURE_OPEN, i, port, tag, len);
+    }
+
+    char *chunk = malloc(HEAVY_CHUNK);
+    for (int i = 0; i < HEAVY_CHUNK; i += 100) {
+        memset(chunk + i, 'x', 100);
+        memcpy(chunk + i, "PRIVMSG #bench :", 16);
+        chunk[i + 98] = '\r';
+        chunk[i + 99] = '\n';
+    }
+
+    double chunk_interval = HEAVY_CHUNK / heavy_rate;
+    double egress_interval = 1 / egress_rate;
+    double next_egress = 2 * TICK;
+    double next_chunk = 2 * TICK;
+    char line[128];
+
+    srand(1);
+
+    for (double t = 2 * TICK; t < duration; t += TICK) {
+        // every light client says something once a second, staggered
+        int second = (int)(t / TICK) % 1000;
+        for (int i = 1 + second; i <= light; i += 1000) {
+            int len = snprintf(line, sizeof(line),
+                "PRIVMSG #bench :hello from %d\r\n", i);
+            record(t, CAPTURE_READ, i, 0, line, len);
+        }
+
+        for (; heavy && next_chunk <= t; next_chunk += chunk_interval)
+            for (int i = light + 1; i <= clients; i++)
+                record(t, CAPTURE_READ, i, 0, chunk, HEAVY_CHUNK);
+
+        // egress goes to one light client at a time, on the normal lane
+        for (; next_egress <= t; next_egress += egress_interval) {
+            int i = 1 + rand() % light;
+            int len = client_tag(line, sizeof(line), i);
+            len += snprintf(line + len, sizeof(line) - len,
+                " :bench PRIVMSG %d :hi\r\n", i);
+            record(t, CAPTURE_EGRESS, 0, 0, line, len);
+        }
+    }
+
+    for (int i = 1; i <= clients; i++)
+        record(duration, CAPTURE_CLOSE, i, 0, "", 0);
+
+    printf("%d light and %d heavy clients over %.1fs\n", light, heavy,
+        duration);
+
+    return 0;
+}
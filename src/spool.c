@@ -0,0 +1,210 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// for ftruncate and fallocate
+#define _GNU_SOURCE 1
+
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "spool.h"
+
+// records are stored as a 32-bit length followed by the data
+#define RECORD_HEADER sizeof(uint32_t)
+#define RECORD_WRAP UINT32_MAX
+
+int spool_init(struct spool *spool, const char *path)
+{
+    *spool = (struct spool) { .fd = -1 };
+
+    spool->ring = malloc(SPOOL_RING_SIZE);
+    if (!spool->ring)
+        return -1;
+
+    // the file is scratch space for this process only; start it empty
+    spool->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (spool->fd == -1)
+        return -1;
+
+    if (ftruncate(spool->fd, SPOOL_FILE_SIZE) == -1)
+        goto fail;
+
+    spool->file = mmap(NULL, SPOOL_FILE_SIZE, PROT_READ | PROT_WRITE,
+        MAP_SHARED, spool->fd, 0);
+    if (spool->file == MAP_FAILED)
+        goto fail;
+
+    return 0;
+
+fail:
+    close(spool->fd);
+    spool->fd = -1;
+    spool->file = NULL;
+    return -1;
+}
+
+static void spool_write(char *p, const char *data, size_t len)
+{
+    uint32_t n = len;
+    memcpy(p, &n, RECORD_HEADER);
+    memcpy(p + RECORD_HEADER, data, len);
+}
+
+static int spool_ring_push(struct spool *spool, const char *data, size_t len)
+{
+    size_t need = RECORD_HEADER + len;
+    size_t head = spool->ring_head;
+    size_t tail = spool->ring_tail;
+
+    if (spool->ring_count == 0)
+        head = tail = 0;
+
+    if (head < tail || (head == tail && spool->ring_count)) {
+        // the free space is the gap between head and tail
+        if (head + need > tail)
+            return -1;
+    }
+    else if (head + need > SPOOL_RING_SIZE) {
+        // no room at the end; wrap around to the start if it fits there
+        if (need > tail)
+            return -1;
+
+        if (SPOOL_RING_SIZE - head >= RECORD_HEADER) {
+            uint32_t wrap = RECORD_WRAP;
+            memcpy(spool->ring + head, &wrap, RECORD_HEADER);
+        }
+
+        head = 0;
+    }
+
+    spool_write(spool->ring + head, data, len);
+    spool->ring_head = head + need;
+    spool->ring_tail = tail;
+    spool->ring_count++;
+
+    return 0;
+}
+
+static int spool_file_push(struct spool *spool, const char *data, size_t len)
+{
+    size_t need = RECORD_HEADER + len;
+
+    if (!spool->file || spool->file_head + need > SPOOL_FILE_SIZE)
+        return -1;
+
+    spool_write(spool->file + spool->file_head, data, len);
+    spool->file_head += need;
+    spool->file_count++;
+
+    return 0;
+}
+
+int spool_push(struct spool *spool, const char *data, size_t len)
+{
+    // once records overflow into the file, keep appending there until it
+    // drains, so that they are read back in order
+    if (spool->file_count == 0 && spool_ring_push(spool, data, len) == 0)
+        return 0;
+
+    if (spool_file_push(spool, data, len) == 0)
+        return 0;
+
+    spool->dropped++;
+    return -1;
+}
+
+static size_t spool_ring_next(struct spool *spool, size_t pos, uint32_t *len)
+{
+    if (SPOOL_RING_SIZE - pos >= RECORD_HEADER)
+        memcpy(len, spool->ring + pos, RECORD_HEADER);
+    else
+        *len = RECORD_WRAP;
+
+    if (*len == RECORD_WRAP) {
+        pos = 0;
+        memcpy(len, spool->ring, RECORD_HEADER);
+    }
+
+    return pos;
+}
+
+size_t spool_read(struct spool *spool, const char **data, size_t *len,
+    size_t max)
+{
+    size_t count = 0;
+    uint32_t n;
+
+    size_t pos = spool->ring_tail;
+    for (size_t i = 0; i < spool->ring_count && count < max; i++) {
+        pos = spool_ring_next(spool, pos, &n);
+        data[count] = spool->ring + pos + RECORD_HEADER;
+        len[count] = n;
+        count++;
+        pos += RECORD_HEADER + n;
+    }
+
+    pos = spool->file_tail;
+    for (size_t i = 0; i < spool->file_count && count < max; i++) {
+        memcpy(&n, spool->file + pos, RECORD_HEADER);
+        data[count] = spool->file + pos + RECORD_HEADER;
+        len[count] = n;
+        count++;
+        pos += RECORD_HEADER + n;
+    }
+
+    return count;
+}
+
+void spool_consume(struct spool *spool, size_t count)
+{
+    uint32_t n;
+
+    for (; count && spool->ring_count; count--) {
+        spool->ring_tail = spool_ring_next(spool, spool->ring_tail, &n);
+        spool->ring_tail += RECORD_HEADER + n;
+        spool->ring_count--;
+    }
+
+    if (spool->ring_count == 0)
+        spool->ring_head = spool->ring_tail = 0;
+
+    for (; count && spool->file_count; count--) {
+        memcpy(&n, spool->file + spool->file_tail, RECORD_HEADER);
+        spool->file_tail += RECORD_HEADER + n;
+        spool->file_count--;
+    }
+
+    if (spool->file_count == 0 && spool->file_head) {
+        // give the blocks back; MADV_DONTNEED would only drop this
+        // mapping's pages and leave them in the page cache and on disk.
+        // without hole punching in the filesystem the space just stays
+        // allocated until it is overwritten
+        fallocate(spool->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0,
+            spool->file_head);
+        spool->file_head = spool->file_tail = 0;
+    }
+}
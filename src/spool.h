@@ -0,0 +1,60 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+// in-memory ring, overflowing into a memory-mapped file
+#define SPOOL_RING_SIZE (1 << 20)
+#define SPOOL_FILE_SIZE (256 << 20)
+
+struct spool {
+    char *ring;
+    size_t ring_head;
+    size_t ring_tail;
+    size_t ring_count;
+
+    int fd;
+    char *file;
+    size_t file_head;
+    size_t file_tail;
+    size_t file_count;
+
+    uint64_t dropped;
+};
+
+int spool_init(struct spool *spool, const char *path);
+
+int spool_push(struct spool *spool, const char *data, size_t len);
+
+size_t spool_read(struct spool *spool, const char **data, size_t *len,
+    size_t max);
+
+void spool_consume(struct spool *spool, size_t count);
+
+static inline size_t spool_depth(struct spool *spool)
+{
+    return spool->ring_count + spool->file_count;
+}
@@ -25,110 +25,205 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include "../sev/sev.h"
 #include "mux.h"
+#include "transform.h"
 
-#define PORT 5555
+// connection-level irc commands are answered locally under this name;
+// cap negotiation is only handled here if the kernel doesn't do it
+static char *irc_server = "irc.local";
+static int irc_cap = 0;
 
-char *name = "tcpmux";
-int irc = 0;
+static int irc_command(const char *cmd, size_t len, const char *name)
+{
+    if (len != strlen(name))
+        return 0;
+
+    for (size_t i = 0; i < len; i++)
+        if (toupper((unsigned char)cmd[i]) != name[i])
+            return 0;
+
+    return 1;
+}
 
-void process_message(char *message)
+static void irc_reply(struct mux_client *client, const char *command,
+    const char *args)
 {
-    if (!irc)
-        return;
+    char reply[BUFFER_SIZE];
+    int len = snprintf(reply, sizeof(reply), ":%s %s %s\r\n", irc_server,
+        command, args);
+
+    if (len >= sizeof(reply))
+        len = sizeof(reply) - 1;
+
+    mux_send(client, reply, len);
+}
+
+// egress rewrites, compiled once at startup
+static struct transform_rule irc_rules[] = {
+    // ":src PRIVMSG target :\x01S font text\x01" -> ":src PRIVMSG target :text"
+    { .command = "PRIVMSG", .action = TRANSFORM_CTCP_STRIP,
+      .match = "S", .fields = 1 },
+};
 
-    char *cmd = strchr(message, ' ');
-    if (!cmd++)
-        return;
+static struct transform egress;
 
-    if (strncmp(cmd, "PRIVMSG", 7))
-        return;
+static int irc_client_message(struct mux_client *client, char *line,
+    size_t len)
+{
+    // skip the prefix, if any
+    if (*line == ':') {
+        line = strchr(line, ' ');
+        if (!line)
+            return 0;
+    }
 
-    char *target = strchr(cmd, ' ');
-    if (!target++)
-        return;
+    while (*line == ' ')
+        line++;
 
-    char *arg = strchr(target, ' ');
-    if (!arg++)
-        return;
+    char *args = strchr(line, ' ');
+    size_t cmd_len = args ? args - line : strlen(line);
 
-    if (strncmp(arg, ":\x01S ", 4))
-        return;
+    if (!args)
+        args = "";
 
-    char *font = strchr(arg, ' ');
-    if (!font++)
-        return;
+    while (*args == ' ')
+        args++;
 
-    char *msg = strchr(font, ' ');
-    if (!msg++)
-        return;
+    // the last parameter is either after " :" or the only one given
+    char *last = strstr(args, " :");
+    last = last ? last + 2 : (*args == ':' ? args + 1 : args);
+
+    if (irc_command(line, cmd_len, "PING")) {
+        char pong[BUFFER_SIZE];
+        snprintf(pong, sizeof(pong), "%s :%s", irc_server, last);
+        irc_reply(client, "PONG", pong);
+        return 1;
+    }
 
-    char *end = strchr(msg, '\r');
-    if (*--end != '\x01')
-        end++;
+    // only replies to our own keepalive are swallowed
+    if (irc_command(line, cmd_len, "PONG"))
+        return !strcmp(last, irc_server);
+
+    if (irc_cap && irc_command(line, cmd_len, "CAP")) {
+        char *sub = args;
+        size_t sub_len = strcspn(sub, " ");
+
+        if (irc_command(sub, sub_len, "LS"))
+            irc_reply(client, "CAP", "* LS :");
+        else if (irc_command(sub, sub_len, "LIST"))
+            irc_reply(client, "CAP", "* LIST :");
+        else if (irc_command(sub, sub_len, "REQ")) {
+            char nak[BUFFER_SIZE];
+            snprintf(nak, sizeof(nak), "* NAK :%s", last);
+            irc_reply(client, "CAP", nak);
+        }
+
+        return 1;
+    }
 
-    *end++ = '\r';
-    *end++ = '\n';
-    *end++ = '\0';
-    memmove(arg + 1, msg, (end - msg));
+    return 0;
 }
 
-void server_message(struct mux_client *client, char *message)
+static char *irc_process_message(char *message, size_t *len)
 {
-    size_t len = strlen(message);
+    return transform_apply(&egress, message, len);
+}
 
+static void server_message(struct mux_client *client, char *message,
+    size_t len)
+{
     // send data
-    sev_send(client->stream, message, len);
+    mux_send(client, message, len);
 }
 
-void server_close(struct mux_client *client)
+static void server_broadcast(struct sev_stream *stream, int flags,
+    char *message, size_t len)
 {
-    sev_close(client->stream, "server_close");
+    sev_send(stream, message, len);
 }
 
-static void open_cb(struct sev_stream *stream)
+static void server_close(struct mux_client *client)
 {
-    struct mux_client *client = mux_client_open(stream);
-    stream->data = client;
+    sev_close(client->stream, "server_close");
 }
 
-static void read_cb(struct sev_stream *stream, char *data, size_t len)
+static void server_token(struct mux_client *client, const char *token)
 {
-    struct mux_client *client = stream->data;
+    char line[16 + MUX_TOKEN_SIZE];
+    int len = snprintf(line, sizeof(line), "RESUME %s\r\n", token);
+    mux_send(client, line, len);
+}
 
-    mux_client_data(client, data, len);
+static void server_error(struct mux_client *client, int code,
+    const char *reason)
+{
+    sev_close(client->stream, reason);
 }
 
-static void close_cb(struct sev_stream *stream, const char *reason)
+static void irc_server_error(struct mux_client *client, int code,
+    const char *reason)
 {
-    struct mux_client *client = stream->data;
+    char error[128];
+    int len = snprintf(error, sizeof(error), "ERROR :%s\r\n", reason);
+    mux_send(client, error, len);
 
-    mux_client_close(client, reason);
+    sev_close(client->stream, reason);
 }
 
-int main(int argc, char *argv[])
+static void irc_server_ping(struct mux_client *client)
 {
-    if (argc > 1 && !strcmp(argv[1], "irc")) {
-        irc = 1;
-        name = "ircmux";
-    }
+    char ping[128];
+    int len = snprintf(ping, sizeof(ping), "PING :%s\r\n", irc_server);
+    mux_send(client, ping, len);
+}
+
+static void irc_init(void)
+{
+    transform_compile(&egress, irc_rules,
+        sizeof(irc_rules) / sizeof(irc_rules[0]));
+}
 
-    mux_init();
+// plain tcp has no keepalive of its own, so pings are just a read timeout
+const struct mux_protocol tcpmux_protocol = {
+    .name = "tcpmux",
+    .port = 5555,
 
-    struct sev_server server;
-    if (sev_listen(&server, PORT)) {
-        perror("sev_server_init");
-        return -1;
-    }
+    // lines/sec, bytes/sec, seconds of burst
+    .ratelimit = { 10, 8192, 2, RATELIMIT_DELAY },
+    .utf8_ingress = UTF8_PASS,
 
-    server.open_cb = open_cb;
-    server.read_cb = read_cb;
-    server.close_cb = close_cb;
+    // a client that sends "RESUME" as its first line gets a token; off by
+    // default, since it delays the connect until that first line
+    .resume = 0,
 
-    printf("%s started on port %d\n", name, PORT);
+    .read = mux_client_data,
 
-    sev_loop();
+    .server_message = server_message,
+    .server_broadcast = server_broadcast,
+    .server_close = server_close,
+    .server_token = server_token,
+    .server_error = server_error,
+};
 
-    return 0;
-}
+const struct mux_protocol ircmux_protocol = {
+    .name = "ircmux",
+    .port = 6667,
+
+    .ratelimit = { 10, 8192, 2, RATELIMIT_DELAY },
+
+    // irc predates utf-8, so legacy encodings are passed through untouched
+    .utf8_ingress = UTF8_PASS,
+
+    .init = irc_init,
+    .read = mux_client_data,
+    .client_message = irc_client_message,
+    .process_message = irc_process_message,
+
+    .server_message = server_message,
+    .server_broadcast = server_broadcast,
+    .server_close = server_close,
+    .server_ping = irc_server_ping,
+    .server_error = irc_server_error,
+};
@@ -0,0 +1,185 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "../sev/sev.h"
+#include "tls.h"
+
+// plaintext held back until the handshake completes
+#define TLS_PENDING 65536
+
+struct tls_server {
+    SSL_CTX *ctx;
+};
+
+struct tls {
+    SSL *ssl;
+    BIO *in;
+    BIO *out;
+
+    // plaintext written before the handshake completed
+    char *pending;
+    size_t pending_len;
+};
+
+struct tls_server *tls_server_new(const char *cert, const char *key)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL)
+        return NULL;
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+            SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(ctx) != 1) {
+        ERR_print_errors_fp(stdout);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    struct tls_server *server = malloc(sizeof(struct tls_server));
+    server->ctx = ctx;
+
+    return server;
+}
+
+struct tls *tls_new(struct tls_server *server)
+{
+    struct tls *tls = calloc(1, sizeof(struct tls));
+
+    tls->ssl = SSL_new(server->ctx);
+    tls->in = BIO_new(BIO_s_mem());
+    tls->out = BIO_new(BIO_s_mem());
+
+    // reading an empty bio means "wait for more", not end of file
+    BIO_set_mem_eof_return(tls->in, -1);
+
+    SSL_set_bio(tls->ssl, tls->in, tls->out);
+    SSL_set_accept_state(tls->ssl);
+
+    return tls;
+}
+
+void tls_free(struct tls *tls)
+{
+    if (tls == NULL)
+        return;
+
+    // frees both bios
+    SSL_free(tls->ssl);
+    free(tls->pending);
+    free(tls);
+}
+
+int tls_ready(struct tls *tls)
+{
+    return SSL_is_init_finished(tls->ssl);
+}
+
+int tls_flush(struct tls *tls, struct sev_stream *stream)
+{
+    char *data;
+    long len = BIO_get_mem_data(tls->out, &data);
+    if (len <= 0)
+        return 0;
+
+    int ret = sev_send(stream, data, len);
+    (void)BIO_reset(tls->out);
+
+    return ret;
+}
+
+static int tls_encrypt(struct tls *tls, const char *data, size_t len)
+{
+    // memory bios never block, so the whole buffer is taken at once
+    if (len && SSL_write(tls->ssl, data, len) <= 0)
+        return -1;
+
+    return 0;
+}
+
+int tls_feed(struct tls *tls, struct sev_stream *stream, const char *data,
+    size_t len)
+{
+    BIO_write(tls->in, data, len);
+
+    if (!SSL_is_init_finished(tls->ssl)) {
+        int ret = SSL_do_handshake(tls->ssl);
+
+        if (ret <= 0 && SSL_get_error(tls->ssl, ret) != SSL_ERROR_WANT_READ) {
+            // send the alert, if there is one
+            tls_flush(tls, stream);
+            return -1;
+        }
+
+        if (ret == 1 && tls->pending) {
+            int failed = tls_encrypt(tls, tls->pending, tls->pending_len);
+            free(tls->pending);
+            tls->pending = NULL;
+            tls->pending_len = 0;
+
+            if (failed)
+                return -1;
+        }
+    }
+
+    return tls_flush(tls, stream);
+}
+
+int tls_recv(struct tls *tls, char *out, size_t size)
+{
+    if (!SSL_is_init_finished(tls->ssl))
+        return 0;
+
+    int n = SSL_read(tls->ssl, out, size);
+    if (n > 0)
+        return n;
+
+    return SSL_get_error(tls->ssl, n) == SSL_ERROR_WANT_READ ? 0 : -1;
+}
+
+int tls_write(struct tls *tls, struct sev_stream *stream, const char *data,
+    size_t len)
+{
+    if (!SSL_is_init_finished(tls->ssl)) {
+        if (tls->pending_len + len > TLS_PENDING)
+            return -1;
+
+        tls->pending = realloc(tls->pending, tls->pending_len + len);
+        memcpy(tls->pending + tls->pending_len, data, len);
+        tls->pending_len += len;
+        return 0;
+    }
+
+    if (tls_encrypt(tls, data, len) == -1)
+        return -1;
+
+    return tls_flush(tls, stream);
+}
@@ -0,0 +1,58 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+
+// userspace tls for sev streams: openssl runs on memory bios, fed with the
+// bytes sev reads and draining its records into sev_send()
+struct tls_server;
+struct tls;
+struct sev_stream;
+
+// cert is a pem chain, key a pem private key; they may be the same file
+struct tls_server *tls_server_new(const char *cert, const char *key);
+
+struct tls *tls_new(struct tls_server *server);
+void tls_free(struct tls *tls);
+
+// feed bytes read from the stream, advancing the handshake and sending
+// whatever it answers; returns -1 on a tls error
+int tls_feed(struct tls *tls, struct sev_stream *stream, const char *data,
+    size_t len);
+
+// decrypted bytes fed so far, up to size; returns 0 when there are none
+// left, and -1 once the peer closed the session or on an error
+int tls_recv(struct tls *tls, char *out, size_t size);
+
+// nonzero once the handshake is complete
+int tls_ready(struct tls *tls);
+
+// send records produced outside of tls_write(), such as after tls_recv()
+int tls_flush(struct tls *tls, struct sev_stream *stream);
+
+// encrypt and send; held back until the handshake completes, up to a limit
+// past which it fails
+int tls_write(struct tls *tls, struct sev_stream *stream, const char *data,
+    size_t len);
@@ -0,0 +1,83 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "trace.h"
+
+void trace_record(struct trace_histogram *histogram, double seconds)
+{
+    uint64_t us = seconds > 0 ? seconds * 1e6 : 0;
+    int bucket = 0;
+
+    while (us > 1 && bucket < TRACE_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+
+    histogram->buckets[bucket]++;
+    histogram->count++;
+
+    if (seconds > histogram->max)
+        histogram->max = seconds;
+}
+
+double trace_quantile(const struct trace_histogram *histogram, double q)
+{
+    uint64_t rank = q * histogram->count;
+    uint64_t seen = 0;
+
+    for (int i = 0; i < TRACE_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen > rank)
+            return (double)(2ULL << i) / 1e6;
+    }
+
+    return histogram->max;
+}
+
+// keeps the TRACE_SLOW largest latencies, replacing the smallest one
+void trace_sample(struct trace_slow *slow, double latency, double wait,
+    size_t recipients, const char *text)
+{
+    struct trace_sample *sample = &slow->samples[slow->count];
+
+    if (slow->count == TRACE_SLOW) {
+        sample = &slow->samples[0];
+        for (int i = 1; i < TRACE_SLOW; i++)
+            if (slow->samples[i].latency < sample->latency)
+                sample = &slow->samples[i];
+
+        if (latency <= sample->latency)
+            return;
+    }
+    else
+        slow->count++;
+
+    sample->latency = latency;
+    sample->wait = wait;
+    sample->recipients = recipients;
+    snprintf(sample->text, sizeof(sample->text), "%s", text);
+}
@@ -0,0 +1,59 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+// latency histogram with power-of-two buckets in microseconds
+#define TRACE_BUCKETS 32
+
+struct trace_histogram {
+    uint64_t buckets[TRACE_BUCKETS];
+    uint64_t count;
+    double max;
+};
+
+// the slowest messages seen since the last reset
+#define TRACE_SLOW 8
+
+struct trace_sample {
+    double latency;
+    double wait;
+    size_t recipients;
+    char text[64];
+};
+
+struct trace_slow {
+    struct trace_sample samples[TRACE_SLOW];
+    size_t count;
+};
+
+void trace_record(struct trace_histogram *histogram, double seconds);
+
+// upper bound, in seconds, of the bucket holding the q-th quantile
+double trace_quantile(const struct trace_histogram *histogram, double q);
+
+void trace_sample(struct trace_slow *slow, double latency, double wait,
+    size_t recipients, const char *text);
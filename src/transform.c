@@ -0,0 +1,216 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "transform.h"
+
+void transform_compile(struct transform *transform,
+    const struct transform_rule *rules, size_t count)
+{
+    *transform = (struct transform) { 0 };
+
+    transform->rules = malloc(count * sizeof(struct transform_rule));
+    memcpy(transform->rules, rules, count * sizeof(struct transform_rule));
+
+    // link in reverse so that rules keep their order within a bucket
+    for (size_t i = count; i-- > 0;) {
+        struct transform_rule *rule = &transform->rules[i];
+        struct transform_rule **head = &transform->any;
+
+        if (rule->command) {
+            int c = toupper((unsigned char)rule->command[0]);
+            head = &transform->buckets[c % TRANSFORM_BUCKETS];
+        }
+
+        rule->next = *head;
+        *head = rule;
+    }
+}
+
+// length of the line ending at the end of the message
+static size_t transform_eol(const char *message, size_t len)
+{
+    size_t n = 0;
+    while (n < len && (message[len - n - 1] == '\r' ||
+            message[len - n - 1] == '\n'))
+        n++;
+
+    return n;
+}
+
+// the message is never changed in place, since it is shared by every
+// listener: the first rule that changes it copies it into the buffer,
+// with room for extra bytes, and later rules work on that copy
+static char *transform_own(struct transform *transform, char *message,
+    size_t len, size_t extra)
+{
+    size_t size = len + extra + 1;
+
+    if (message == transform->buffer) {
+        if (size > transform->size) {
+            transform->size = size;
+            transform->buffer = realloc(transform->buffer, size);
+        }
+        return transform->buffer;
+    }
+
+    if (size > transform->size) {
+        free(transform->buffer);
+        transform->size = size;
+        transform->buffer = malloc(size);
+    }
+
+    memcpy(transform->buffer, message, len);
+    transform->buffer[len] = '\0';
+
+    return transform->buffer;
+}
+
+static char *transform_ctcp(struct transform *transform,
+    struct transform_rule *rule, char *message, size_t *len, char *params)
+{
+    char *end = message + *len;
+    char *eol = end - transform_eol(message, *len);
+
+    // the trailing parameter starts at the first " :"
+    char *arg = strstr(params, " :");
+    if (!arg || arg >= eol)
+        return message;
+    arg += 2;
+
+    size_t match_len = strlen(rule->match);
+    if (eol - arg < match_len + 2 || arg[0] != '\x01' ||
+            memcmp(arg + 1, rule->match, match_len) ||
+            arg[1 + match_len] != ' ')
+        return message;
+
+    char *text = arg + 2 + match_len;
+    for (int i = 0; i < rule->fields; i++) {
+        text = memchr(text, ' ', eol - text);
+        if (!text)
+            return message;
+        text++;
+    }
+
+    char *text_end = eol;
+    if (text_end > text && text_end[-1] == '\x01')
+        text_end--;
+
+    size_t arg_at = arg - message;
+    size_t text_at = text - message;
+    size_t text_len = text_end - text;
+    size_t eol_at = eol - message;
+    size_t eol_len = end - eol;
+
+    message = transform_own(transform, message, *len, 0);
+
+    // shift the text and the original line ending down over the ctcp
+    memmove(message + arg_at, message + text_at, text_len);
+    memmove(message + arg_at + text_len, message + eol_at, eol_len);
+
+    *len = arg_at + text_len + eol_len;
+    message[*len] = '\0';
+
+    return message;
+}
+
+static char *transform_rename(struct transform *transform,
+    struct transform_rule *rule, char *message, size_t *len, char *command,
+    size_t command_len)
+{
+    size_t value_len = strlen(rule->value);
+    size_t before = command - message;
+    size_t after = *len - before - command_len;
+
+    message = transform_own(transform, message, *len, value_len);
+
+    memmove(message + before + value_len,
+        message + before + command_len, after + 1);
+    memcpy(message + before, rule->value, value_len);
+
+    *len = before + value_len + after;
+    return message;
+}
+
+char *transform_apply(struct transform *transform, char *message,
+    size_t *len)
+{
+    // find the command, after the optional prefix
+    char *command = message;
+    if (*command == ':') {
+        command = strchr(command, ' ');
+        if (!command)
+            return message;
+        command++;
+    }
+
+    size_t command_len = strcspn(command, " \r\n");
+    if (command_len == 0)
+        return message;
+
+    int c = toupper((unsigned char)command[0]);
+    struct transform_rule *rule = transform->buckets[c % TRANSFORM_BUCKETS];
+
+    for (; rule; rule = rule->next) {
+        if (strlen(rule->command) != command_len ||
+                memcmp(rule->command, command, command_len))
+            continue;
+
+        switch (rule->action) {
+        case TRANSFORM_CTCP_STRIP: {
+            size_t offset = command - message;
+            message = transform_ctcp(transform, rule, message, len,
+                command + command_len);
+            command = message + offset;
+            break;
+        }
+
+        case TRANSFORM_RENAME: {
+            size_t offset = command - message;
+            message = transform_rename(transform, rule, message, len,
+                command, command_len);
+            command = message + offset;
+            command_len = strlen(rule->value);
+            break;
+        }
+        }
+    }
+
+    for (rule = transform->any; rule; rule = rule->next) {
+        if (rule->action != TRANSFORM_CRLF_STRIP)
+            continue;
+
+        size_t eol = transform_eol(message, *len);
+        if (eol) {
+            message = transform_own(transform, message, *len, 0);
+            *len -= eol;
+            message[*len] = '\0';
+        }
+    }
+
+    return message;
+}
@@ -0,0 +1,64 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+
+enum transform_action {
+    // unwrap "\x01<match> ...\x01" in the trailing parameter, also dropping
+    // the first <fields> words after the ctcp tag
+    TRANSFORM_CTCP_STRIP,
+    // replace the command with <value>
+    TRANSFORM_RENAME,
+    // drop the trailing line ending
+    TRANSFORM_CRLF_STRIP,
+};
+
+struct transform_rule {
+    const char *command;    // NULL matches every message
+    int action;
+    const char *match;
+    int fields;
+    const char *value;
+
+    struct transform_rule *next;
+};
+
+#define TRANSFORM_BUCKETS 128
+
+// rules compiled into a table indexed by the first byte of the command
+struct transform {
+    struct transform_rule *rules;
+    struct transform_rule *buckets[TRANSFORM_BUCKETS];
+    struct transform_rule *any;
+
+    char *buffer;
+    size_t size;
+};
+
+void transform_compile(struct transform *transform,
+    const struct transform_rule *rules, size_t count);
+
+char *transform_apply(struct transform *transform, char *message,
+    size_t *len);
@@ -0,0 +1,159 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// for clock_gettime
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "transform.h"
+
+// ircmux's egress rewrite: transform_apply() with ircmux's rule against
+// the hand-written process_message() it replaced, which rewrote the
+// message in place, so that one is timed on a fresh copy every round
+#define ITERATIONS 10000000
+
+static struct transform_rule rules[] = {
+    { .command = "PRIVMSG", .action = TRANSFORM_CTCP_STRIP,
+      .match = "S", .fields = 1 },
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the removed tcpmux.c process_message(), as it was
+static void process_message(char *message)
+{
+    char *cmd = strchr(message, ' ');
+    if (!cmd++)
+        return;
+
+    if (strncmp(cmd, "PRIVMSG", 7))
+        return;
+
+    char *target = strchr(cmd, ' ');
+    if (!target++)
+        return;
+
+    char *arg = strchr(target, ' ');
+    if (!arg++)
+        return;
+
+    if (strncmp(arg, ":\x01S ", 4))
+        return;
+
+    char *font = strchr(arg, ' ');
+    if (!font++)
+        return;
+
+    char *msg = strchr(font, ' ');
+    if (!msg++)
+        return;
+
+    char *end = strchr(msg, '\r');
+    if (*--end != '\x01')
+        end++;
+
+    *end++ = '\r';
+    *end++ = '\n';
+    *end++ = '\0';
+    memmove(arg + 1, msg, (end - msg));
+}
+
+// usage: transformbench [iterations]
+int main(int argc, char *argv[])
+{
+    long iterations = argc > 1 ? atol(argv[1]) : ITERATIONS;
+    static const struct {
+        const char *name;
+        const char *message;
+    } cases[] = {
+        { "ctcp S", ":nick!user@host PRIVMSG #channel :\x01S arial "
+            "hello there, how is it going?\x01\r\n" },
+        { "privmsg", ":nick!user@host PRIVMSG #channel :hello there, how "
+            "is it going?\r\n" },
+        { "join", ":nick!user@host JOIN #channel\r\n" },
+    };
+
+    struct transform transform;
+    transform_compile(&transform, rules, sizeof(rules) / sizeof(rules[0]));
+
+    size_t sink = 0;
+
+    for (int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        size_t len = strlen(cases[i].message);
+        char message[256];
+        char copy[256];
+
+        memcpy(message, cases[i].message, len + 1);
+
+        // both must produce the same line
+        size_t out_len = len;
+        char *out = transform_apply(&transform, message, &out_len);
+        memcpy(copy, message, len + 1);
+        process_message(copy);
+
+        if (out_len != strlen(copy) || memcmp(out, copy, out_len)) {
+            fprintf(stderr, "rewrites differ for %s\n", cases[i].name);
+            return -1;
+        }
+
+        double start = now();
+        for (long j = 0; j < iterations; j++) {
+            memcpy(copy, message, len + 1);
+            sink += copy[j % len];
+        }
+        double copied = (now() - start) / iterations;
+
+        start = now();
+        for (long j = 0; j < iterations; j++) {
+            memcpy(copy, message, len + 1);
+            process_message(copy);
+            sink += copy[j % len];
+        }
+        double old = (now() - start) / iterations - copied;
+
+        start = now();
+        for (long j = 0; j < iterations; j++) {
+            out_len = len;
+            out = transform_apply(&transform, message, &out_len);
+            sink += out[out_len - 1];
+        }
+        double apply = (now() - start) / iterations;
+
+        printf("%-8s process_message %.1fns transform_apply %.1fns "
+            "(copy %.1fns)\n", cases[i].name, old * 1e9, apply * 1e9,
+            copied * 1e9);
+    }
+
+    // keep the loops from being optimized out
+    return sink == 0;
+}
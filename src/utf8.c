@@ -0,0 +1,279 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "utf8.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UTF8_SSSE3 1
+#include <tmmintrin.h>
+#endif
+
+// length of the valid sequence at the start of s, or 0 if it is invalid
+static size_t utf8_sequence(const uint8_t *s, size_t len)
+{
+    uint8_t c = s[0];
+
+    if (c < 0x80)
+        return 1;
+
+    size_t n;
+    uint8_t lo = 0x80, hi = 0xbf;
+
+    if (c >= 0xc2 && c <= 0xdf)
+        n = 2;
+    else if (c >= 0xe0 && c <= 0xef) {
+        n = 3;
+        if (c == 0xe0)
+            lo = 0xa0;  // overlong
+        if (c == 0xed)
+            hi = 0x9f;  // surrogates
+    }
+    else if (c >= 0xf0 && c <= 0xf4) {
+        n = 4;
+        if (c == 0xf0)
+            lo = 0x90;  // overlong
+        if (c == 0xf4)
+            hi = 0x8f;  // above U+10FFFF
+    }
+    else
+        return 0;
+
+    if (len < n || s[1] < lo || s[1] > hi)
+        return 0;
+
+    for (size_t i = 2; i < n; i++)
+        if ((s[i] & 0xc0) != 0x80)
+            return 0;
+
+    return n;
+}
+
+static int utf8_valid_scalar(const char *data, size_t len)
+{
+    const uint8_t *s = (const uint8_t *)data;
+    size_t i = 0;
+
+    while (i < len) {
+        // skip ascii a word at a time
+        if (len - i >= 8) {
+            uint64_t word;
+            memcpy(&word, s + i, 8);
+            if (!(word & 0x8080808080808080ULL)) {
+                i += 8;
+                continue;
+            }
+        }
+
+        size_t n = utf8_sequence(s + i, len - i);
+        if (n == 0)
+            return 0;
+
+        i += n;
+    }
+
+    return 1;
+}
+
+#ifdef UTF8_SSSE3
+
+// range-based lookup validation (Keiser & Lemire, "Validating UTF-8 in less
+// than one instruction per byte"): three nibble lookups classify every pair
+// of adjacent bytes, and a separate check catches missing continuations
+#define TOO_SHORT (1 << 0)
+#define TOO_LONG (1 << 1)
+#define OVERLONG_3 (1 << 2)
+#define TOO_LARGE (1 << 3)
+#define SURROGATE (1 << 4)
+#define OVERLONG_2 (1 << 5)
+#define TOO_LARGE_1000 (1 << 6)
+#define OVERLONG_4 (1 << 6)
+#define TWO_CONTS (1 << 7)
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define SSSE3 __attribute__((target("ssse3")))
+
+SSSE3 static __m128i utf8_high_nibble(__m128i v)
+{
+    return _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0f));
+}
+
+SSSE3 static __m128i utf8_check_block(__m128i input, __m128i prev_input)
+{
+    const __m128i byte_1_high_table = _mm_setr_epi8(
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        TOO_SHORT | OVERLONG_2,
+        TOO_SHORT,
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+
+    const __m128i byte_1_low_table = _mm_setr_epi8(
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+        CARRY | OVERLONG_2,
+        CARRY,
+        CARRY,
+        CARRY | TOO_LARGE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000);
+
+    const __m128i byte_2_high_table = _mm_setr_epi8(
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 |
+            OVERLONG_4,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+
+    __m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+    __m128i prev2 = _mm_alignr_epi8(input, prev_input, 14);
+    __m128i prev3 = _mm_alignr_epi8(input, prev_input, 13);
+
+    __m128i special = _mm_and_si128(
+        _mm_and_si128(
+            _mm_shuffle_epi8(byte_1_high_table, utf8_high_nibble(prev1)),
+            _mm_shuffle_epi8(byte_1_low_table,
+                _mm_and_si128(prev1, _mm_set1_epi8(0x0f)))),
+        _mm_shuffle_epi8(byte_2_high_table, utf8_high_nibble(input)));
+
+    // bytes two and three after a 3 or 4 byte lead must be continuations
+    __m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8(0xe0 - 0x80));
+    __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8(0xf0 - 0x80));
+    __m128i must_continue = _mm_and_si128(_mm_or_si128(third, fourth),
+        _mm_set1_epi8((char)0x80));
+
+    return _mm_xor_si128(must_continue, special);
+}
+
+// nonzero where the block ends in the middle of a sequence
+SSSE3 static __m128i utf8_incomplete(__m128i input)
+{
+    const __m128i max = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, 0xf0 - 1, 0xe0 - 1, 0xc0 - 1);
+
+    return _mm_subs_epu8(input, max);
+}
+
+SSSE3 static int utf8_valid_ssse3(const char *data, size_t len)
+{
+    __m128i error = _mm_setzero_si128();
+    __m128i prev_input = _mm_setzero_si128();
+    __m128i prev_incomplete = _mm_setzero_si128();
+
+    size_t i = 0;
+    char tail[16];
+
+    while (i < len) {
+        __m128i input;
+
+        if (len - i >= 16)
+            input = _mm_loadu_si128((const __m128i *)(data + i));
+        else {
+            // pad the last block with ascii
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, data + i, len - i);
+            input = _mm_loadu_si128((const __m128i *)tail);
+        }
+
+        i += 16;
+
+        if (_mm_movemask_epi8(input) == 0) {
+            error = _mm_or_si128(error, prev_incomplete);
+            prev_incomplete = _mm_setzero_si128();
+        }
+        else {
+            error = _mm_or_si128(error, utf8_check_block(input, prev_input));
+            prev_incomplete = utf8_incomplete(input);
+        }
+
+        prev_input = input;
+    }
+
+    error = _mm_or_si128(error, prev_incomplete);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128()))
+        == 0xffff;
+}
+
+#endif
+
+static int utf8_valid_resolve(const char *data, size_t len);
+
+static int (*utf8_valid_impl)(const char *, size_t) = utf8_valid_resolve;
+
+// pick an implementation on first use
+static int utf8_valid_resolve(const char *data, size_t len)
+{
+    utf8_valid_impl = utf8_valid_scalar;
+
+#ifdef UTF8_SSSE3
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+        utf8_valid_impl = utf8_valid_ssse3;
+#endif
+
+    return utf8_valid_impl(data, len);
+}
+
+int utf8_valid(const char *data, size_t len)
+{
+    return utf8_valid_impl(data, len);
+}
+
+size_t utf8_sanitize(char *dst, const char *src, size_t len)
+{
+    const uint8_t *s = (const uint8_t *)src;
+    size_t out = 0;
+
+    for (size_t i = 0; i < len;) {
+        size_t n = utf8_sequence(s + i, len - i);
+
+        if (n == 0) {
+            memcpy(dst + out, "\xef\xbf\xbd", 3);
+            out += 3;
+            i++;
+            continue;
+        }
+
+        memcpy(dst + out, src + i, n);
+        out += n;
+        i += n;
+    }
+
+    return out;
+}
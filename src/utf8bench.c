@@ -0,0 +1,149 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// for clock_gettime
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// the implementations are static, so they are compiled in from here
+#include "utf8.c"
+
+// utf-8 validation throughput, scalar and ssse3, against a memcpy of the
+// same bytes, for ascii chat lines and for text that is mostly multibyte
+#define BYTES (1 << 30)
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// fill with copies of the sample, cut at a character boundary
+static size_t fill(char *data, size_t len, const char *sample)
+{
+    size_t sample_len = strlen(sample);
+    size_t n = 0;
+
+    while (n + sample_len <= len) {
+        memcpy(data + n, sample, sample_len);
+        n += sample_len;
+    }
+
+    return n;
+}
+
+static size_t sink;
+
+static double bench_memcpy(char *dst, const char *src, size_t len,
+    long rounds)
+{
+    double start = now();
+    for (long i = 0; i < rounds; i++) {
+        memcpy(dst, src, len);
+        sink += dst[i % len];
+    }
+    return (now() - start) / rounds;
+}
+
+static double bench_valid(int (*valid)(const char *, size_t),
+    const char *data, size_t len, long rounds)
+{
+    double start = now();
+    for (long i = 0; i < rounds; i++)
+        sink += valid(data, len);
+    return (now() - start) / rounds;
+}
+
+// usage: utf8bench [bytes per size]
+int main(int argc, char *argv[])
+{
+    long bytes = argc > 1 ? atol(argv[1]) : BYTES;
+    static const size_t sizes[] = { 64, 1024, 65536 };
+    static const struct {
+        const char *name;
+        const char *sample;
+    } texts[] = {
+        { "ascii", "PRIVMSG #channel :hello there, how is it going? " },
+        { "mixed", "PRIVMSG #canal :ol\xc3\xa1, tudo bem? \xe6\x97\xa5\xe6"
+            "\x9c\xac\xe8\xaa\x9e \xf0\x9f\x98\x80 " },
+    };
+
+    char *data = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+    char *copy = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+
+#ifdef UTF8_SSSE3
+    __builtin_cpu_init();
+    int ssse3 = __builtin_cpu_supports("ssse3");
+#else
+    int ssse3 = 0;
+#endif
+
+    for (int t = 0; t < sizeof(texts) / sizeof(texts[0]); t++) {
+        for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            size_t len = fill(data, sizes[i], texts[t].sample);
+            long rounds = bytes / len;
+
+            if (!utf8_valid_scalar(data, len)) {
+                fprintf(stderr, "%s sample is not valid\n", texts[t].name);
+                return -1;
+            }
+
+            double copied = bench_memcpy(copy, data, len, rounds);
+            double scalar = bench_valid(utf8_valid_scalar, data, len,
+                rounds);
+
+            printf("%s %6zu bytes: memcpy %.2fGB/s scalar %.2fGB/s "
+                "(%.2fx memcpy)", texts[t].name, len, len / copied / 1e9,
+                len / scalar / 1e9, scalar / copied);
+
+#ifdef UTF8_SSSE3
+            if (ssse3) {
+                if (!utf8_valid_ssse3(data, len)) {
+                    fprintf(stderr, "\nssse3 rejects the %s sample\n",
+                        texts[t].name);
+                    return -1;
+                }
+
+                double simd = bench_valid(utf8_valid_ssse3, data, len,
+                    rounds);
+                printf(" ssse3 %.2fGB/s (%.2fx memcpy)", len / simd / 1e9,
+                    simd / copied);
+            }
+#endif
+
+            printf("\n");
+        }
+    }
+
+    if (!ssse3)
+        printf("no ssse3 on this cpu\n");
+
+    // keep the loops from being optimized out
+    return sink == 0;
+}
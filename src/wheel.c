@@ -0,0 +1,131 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include "wheel.h"
+
+#define WHEEL_RANGE (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+
+static void wheel_link(struct wheel_timer **head, struct wheel_timer *timer)
+{
+    timer->next = *head;
+    if (timer->next)
+        timer->next->prev = &timer->next;
+
+    timer->prev = head;
+    *head = timer;
+}
+
+static void wheel_insert(struct wheel *wheel, struct wheel_timer *timer)
+{
+    uint64_t delta = timer->expires - wheel->now;
+
+    // pick the lowest level whose span covers the delta
+    int level = 0;
+    while (delta >= (1ULL << (WHEEL_BITS * (level + 1))))
+        level++;
+
+    int slot = (timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    wheel_link(&wheel->slots[level][slot], timer);
+}
+
+void wheel_init(struct wheel *wheel, uint64_t now)
+{
+    *wheel = (struct wheel) { .now = now };
+}
+
+void wheel_add(struct wheel *wheel, struct wheel_timer *timer, uint64_t ticks)
+{
+    wheel_del(timer);
+
+    if (ticks == 0)
+        ticks = 1;
+
+    if (ticks >= WHEEL_RANGE)
+        ticks = WHEEL_RANGE - 1;
+
+    timer->expires = wheel->now + ticks;
+    wheel_insert(wheel, timer);
+}
+
+void wheel_del(struct wheel_timer *timer)
+{
+    if (!timer->prev)
+        return;
+
+    *timer->prev = timer->next;
+    if (timer->next)
+        timer->next->prev = timer->prev;
+
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+// detach a slot into a local list, so callbacks can safely cancel any of
+// the timers that are still waiting to run
+static void wheel_take(struct wheel_timer **slot, struct wheel_timer **list)
+{
+    *list = *slot;
+    *slot = NULL;
+
+    if (*list)
+        (*list)->prev = list;
+}
+
+static void wheel_cascade(struct wheel *wheel, int level)
+{
+    int slot = (wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+    struct wheel_timer *list, *timer;
+    wheel_take(&wheel->slots[level][slot], &list);
+
+    while ((timer = list) != NULL) {
+        wheel_del(timer);
+        wheel_insert(wheel, timer);
+    }
+}
+
+void wheel_advance(struct wheel *wheel, uint64_t now)
+{
+    while (wheel->now < now) {
+        wheel->now++;
+
+        // move timers down from the upper levels when a lower one wraps
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if ((wheel->now >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK)
+                break;
+
+            wheel_cascade(wheel, level);
+        }
+
+        struct wheel_timer *list, *timer;
+        wheel_take(&wheel->slots[0][wheel->now & WHEEL_MASK], &list);
+
+        while ((timer = list) != NULL) {
+            wheel_del(timer);
+            timer->cb(timer);
+        }
+    }
+}
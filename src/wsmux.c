@@ -23,109 +23,751 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+// for memmem
+#define _GNU_SOURCE 1
+
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <zlib.h>
 #include "../sev/sev.h"
 #include "../libws/ws.h"
 #include "mux.h"
 
-#define PORT 8888
+// permessage-deflate: smaller messages are sent uncompressed
+#define DEFLATE_MIN 64
+#define INFLATE_MAX (1 << 20)
+
+// largest message reassembled from fragments in message mode
+#define MESSAGE_MAX 65536
+
+// slot flag of clients that negotiated permessage-deflate
+#define WS_FLAG_DEFLATE MUX_FLAG_PROTOCOL
+
+#define DEFLATE_EXTENSION "Sec-WebSocket-Extensions: permessage-deflate; " \
+    "server_no_context_takeover; client_no_context_takeover"
+
+// echoed when the offer named it, as rfc 7692 requires
+#define DEFLATE_WINDOW_BITS "; server_max_window_bits=15"
+
+struct ws_client {
+    struct ws_parser parser;
+
+    // 2 if the offer also named server_max_window_bits
+    int deflate;
+    int compressed;
+    uint64_t frame_received;
+    size_t inflated;
+    z_stream *inflate;
+    int inflate_done;
+
+    // message being reassembled, and the control frame being read
+    int binary;
+    char *message;
+    size_t message_len;
+    char control[125];
+    size_t control_len;
+
+    // close code and reason when frame_cb stops the parser; the client is
+    // only closed once ws_parse_all() returns, since that frees the parser.
+    // a zero code closes without a close frame, after echoing the client's
+    int parsing;
+    int error;
+    const char *error_reason;
+
+    // "?resume" or "?resume=<token>" on the request
+    int resume;
+    char token[MUX_TOKEN_SIZE + 1];
+};
+
+static int utf8_egress = UTF8_REPLACE;
+
+// each websocket message becomes one kernel event, instead of one per line;
+// off by default, since it changes what the kernel sees: messages may hold
+// newlines, and binary ones arrive as "binary" events
+static int message_mode = 0;
+
+// outgoing messages starting with this byte, which never occurs in utf-8,
+// are sent as binary frames
+#define EGRESS_BINARY '\xff'
 
-char *name = "wsmux";
+// what process_message() hands to server_message() and server_broadcast():
+// the message framed once for every recipient, with room to frame it again
+// compressed, which is done the first time a deflate client needs it
+struct ws_egress {
+    char *frame;
+    size_t frame_len;
 
-void process_message(char *message)
+    char *payload;
+    size_t payload_len;
+    int opcode;
+
+    // 1 once compressed, -1 if it is sent uncompressed to everyone
+    int deflated;
+    char *compressed;
+    size_t compressed_len;
+    size_t compressed_size;
+
+    char data[];
+};
+
+// reused for every message; only grows, so a second wsmux listener
+// processing the same message rebuilds it in place under the first
+static struct ws_egress *egress;
+static size_t egress_size;
+
+// without context takeover every recipient gets the same compressed bytes,
+// so each message is deflated at most once
+static z_stream deflater;
+
+static char *process_message(char *message, size_t *len)
 {
+    char *payload = message;
+    size_t payload_len = *len;
+    int opcode = WS_TEXT;
+    int sanitize = 0;
+
+    if (message[0] == EGRESS_BINARY) {
+        payload++;
+        payload_len--;
+        opcode = WS_BINARY;
+    }
+    else if (utf8_egress != UTF8_PASS && !utf8_valid(payload, payload_len)) {
+        if (utf8_egress == UTF8_REJECT) {
+            *len = 0;
+            return NULL;
+        }
+
+        sanitize = 1;
+    }
+
+    // the payload goes right after room for the longest header, which is
+    // then written just in front of it
+    size_t payload_max = sanitize ? 3 * payload_len : payload_len;
+    size_t compressed_size = WS_FRAME_HEADER_SIZE +
+        deflateBound(&deflater, payload_max) + 16;
+    size_t size = sizeof(struct ws_egress) + WS_FRAME_HEADER_SIZE +
+        payload_max + compressed_size;
+
+    if (size > egress_size) {
+        free(egress);
+        egress = malloc(size);
+        egress_size = size;
+    }
+
+    egress->payload = egress->data + WS_FRAME_HEADER_SIZE;
+    egress->payload_len = sanitize ?
+        utf8_sanitize(egress->payload, payload, payload_len) : payload_len;
+    if (!sanitize)
+        memcpy(egress->payload, payload, payload_len);
+    egress->opcode = opcode;
+
+    char header[WS_FRAME_HEADER_SIZE];
+    int header_len = ws_write_frame_header(header, opcode,
+        egress->payload_len);
+    egress->frame = egress->payload - header_len;
+    egress->frame_len = header_len + egress->payload_len;
+    memcpy(egress->frame, header, header_len);
+
+    egress->deflated = egress->payload_len < DEFLATE_MIN ? -1 : 0;
+    egress->compressed = egress->payload + payload_max;
+    egress->compressed_size = compressed_size;
+
+    *len = size;
+    return (char *)egress;
 }
 
-void server_message(struct mux_client *client, char *message)
+static int deflate_message(struct ws_egress *egress)
 {
-    size_t len = strlen(message);
+    char *out = egress->compressed + WS_FRAME_HEADER_SIZE;
+    size_t out_size = egress->compressed_size - WS_FRAME_HEADER_SIZE;
+
+    deflateReset(&deflater);
+    deflater.next_in = (Bytef *)egress->payload;
+    deflater.avail_in = egress->payload_len;
+    deflater.next_out = (Bytef *)out;
+    deflater.avail_out = out_size;
+
+    if (deflate(&deflater, Z_SYNC_FLUSH) != Z_OK || deflater.avail_in)
+        return -1;
+
+    // strip the 00 00 ff ff trailer left by the sync flush
+    size_t len = out_size - deflater.avail_out - 4;
 
-    // send websocket header
     char header[WS_FRAME_HEADER_SIZE];
-    int header_len = ws_write_frame_header(header, WS_TEXT, len);
-    if (sev_send(client->stream, header, header_len) == -1)
+    int header_len = ws_write_frame_header(header, egress->opcode, len);
+    header[0] |= 0x40;  // rsv1
+
+    egress->compressed = out - header_len;
+    egress->compressed_len = header_len + len;
+    memcpy(egress->compressed, header, header_len);
+
+    return 0;
+}
+
+// the frame to send a client, compressed if it negotiated deflate
+static void ws_egress_frame(struct ws_egress *egress, int deflate,
+    char **frame, size_t *len)
+{
+    if (deflate && egress->deflated == 0)
+        egress->deflated = deflate_message(egress) == 0 ? 1 : -1;
+
+    if (deflate && egress->deflated == 1) {
+        *frame = egress->compressed;
+        *len = egress->compressed_len;
+        return;
+    }
+
+    *frame = egress->frame;
+    *len = egress->frame_len;
+}
+
+static void server_message(struct mux_client *client, char *message,
+    size_t len)
+{
+    // dropped by process_message()
+    if (message == NULL)
+        return;
+
+    char *frame;
+    ws_egress_frame((struct ws_egress *)message,
+        client->flags & WS_FLAG_DEFLATE, &frame, &len);
+    mux_send(client, frame, len);
+}
+
+static void server_broadcast(struct sev_stream *stream, int flags,
+    char *message, size_t len)
+{
+    if (message == NULL)
         return;
 
-    // send data
-    sev_send(client->stream, message, len);
+    char *frame;
+    ws_egress_frame((struct ws_egress *)message, flags & WS_FLAG_DEFLATE,
+        &frame, &len);
+    sev_send(stream, frame, len);
 }
 
-void server_close(struct mux_client *client)
+static void server_close(struct mux_client *client)
 {
     sev_close(client->stream, "server_close");
 }
 
+static void server_error(struct mux_client *client, int code,
+    const char *reason)
+{
+    struct ws_client *ws = client->data;
+
+    // mux rejecting a frame's payload, from inside frame_cb
+    if (ws->parsing) {
+        if (!ws->error_reason) {
+            ws->error = code;
+            ws->error_reason = reason;
+        }
+        return;
+    }
+
+    size_t len = strlen(reason);
+    if (len > 123)
+        len = 123;
+
+    // close frame payload: 16-bit status code followed by the reason
+    char frame[WS_FRAME_HEADER_SIZE + 125];
+    int header_len = ws_write_frame_header(frame, WS_CLOSE, 2 + len);
+    frame[header_len] = code >> 8;
+    frame[header_len + 1] = code & 0xff;
+    memcpy(frame + header_len + 2, reason, len);
+    mux_send(client, frame, header_len + 2 + len);
+
+    sev_close(client->stream, reason);
+}
+
+static void server_token(struct mux_client *client, const char *token)
+{
+    char message[WS_FRAME_HEADER_SIZE + 8 + MUX_TOKEN_SIZE];
+    int header_len = ws_write_frame_header(message, WS_TEXT,
+        7 + strlen(token));
+    int len = sprintf(message + header_len, "resume %s", token);
+    mux_send(client, message, header_len + len);
+}
+
+static void server_ping(struct mux_client *client)
+{
+    char header[WS_FRAME_HEADER_SIZE];
+    int header_len = ws_write_frame_header(header, WS_PING, 0);
+    mux_send(client, header, header_len);
+}
+
 static int header_cb(struct ws_header *header, void *data)
 {
     struct mux_client *client = data;
+    struct ws_client *ws = client->data;
 
-    char buffer[WS_HTTP_RESPONSE_SIZE];
+    char buffer[WS_HTTP_RESPONSE_SIZE + sizeof(DEFLATE_EXTENSION) +
+        sizeof(DEFLATE_WINDOW_BITS)];
     ws_write_http_handshake(buffer, header->websocket_key);
-    sev_send(client->stream, buffer, strlen(buffer));
+
+    // insert the extension before the blank line that ends the response
+    if (ws->deflate)
+        sprintf(buffer + strlen(buffer) - 2, "%s%s\r\n\r\n",
+            DEFLATE_EXTENSION, ws->deflate == 2 ? DEFLATE_WINDOW_BITS : "");
+
+    mux_send(client, buffer, strlen(buffer));
+
+    mux_client_state(client, MUX_ACTIVE);
+    mux_client_resume(client, ws->resume ? ws->token : NULL);
 
     return 0;
 }
 
-static int frame_cb(struct ws_frame *frame, void *data)
+// look for a resume parameter in the query string of the request line,
+// "GET /path?resume=<token> HTTP/1.1"
+static void ws_resume(struct ws_client *ws, char *data, size_t len)
 {
-    struct mux_client *client = data;
+    if (len < 4 || memcmp(data, "GET ", 4))
+        return;
+
+    char line[BUFFER_SIZE];
+    char *end = memchr(data, '\n', len);
+    size_t n = end ? end - data : len;
 
-    mux_client_data(client, frame->chunk_data, frame->chunk_len);
+    if (n >= sizeof(line))
+        n = sizeof(line) - 1;
+
+    memcpy(line, data, n);
+    line[n] = '\0';
+
+    char *query = strchr(line, '?');
+    if (query == NULL)
+        return;
+
+    query[strcspn(query, " ")] = '\0';
+
+    char *param = strtok(query + 1, "&");
+    for (; param != NULL; param = strtok(NULL, "&")) {
+        if (strncmp(param, "resume", 6) || (param[6] && param[6] != '='))
+            continue;
+
+        char *token = param[6] ? param + 7 : "";
+        size_t i = 0;
+        for (; i < MUX_TOKEN_SIZE && isxdigit((unsigned char)token[i]); i++)
+            ws->token[i] = token[i];
+
+        ws->token[i] = '\0';
+        ws->resume = 1;
+        return;
+    }
+}
+
+static char *ws_trim(char *s)
+{
+    while (*s == ' ' || *s == '\t')
+        s++;
+
+    char *end = s + strlen(s);
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t'))
+        *--end = '\0';
+
+    return s;
+}
+
+// one "permessage-deflate; param; param=value" offer: every recipient
+// shares the deflate output of a full window, and the inflate state is
+// reset after every message, so offers that cap the server window below
+// 15 bits, or carry anything else unknown, are declined; returns 2 for an
+// accepted offer that named server_max_window_bits
+static int ws_deflate_offer(char *offer)
+{
+    int accept = 1;
+
+    char *param = strtok(offer, ";");
+    if (param == NULL || strcmp(ws_trim(param), "permessage-deflate"))
+        return 0;
+
+    while ((param = strtok(NULL, ";")) != NULL) {
+        char *value = strchr(param, '=');
+        if (value) {
+            *value++ = '\0';
+            value = ws_trim(value);
+
+            size_t n = strlen(value);
+            if (n >= 2 && value[0] == '"' && value[n - 1] == '"') {
+                value[n - 1] = '\0';
+                value++;
+            }
+        }
+
+        param = ws_trim(param);
+
+        if (!strcmp(param, "server_no_context_takeover") ||
+                !strcmp(param, "client_no_context_takeover")) {
+            if (value)
+                return 0;
+        }
+        else if (!strcmp(param, "client_max_window_bits")) {
+            // inflating with the full window reads anything smaller
+            if (value && (atoi(value) < 8 || atoi(value) > 15))
+                return 0;
+        }
+        else if (!strcmp(param, "server_max_window_bits")) {
+            if (!value || atoi(value) != 15)
+                return 0;
+            accept = 2;
+        }
+        else
+            return 0;
+    }
+
+    return accept;
+}
+
+// accept the first acceptable permessage-deflate offer of any
+// Sec-WebSocket-Extensions header in the request head, as ws_deflate_offer()
+static int ws_extensions(char *data, size_t len)
+{
+    static const char name[] = "Sec-WebSocket-Extensions:";
+    char *end = memmem(data, len, "\r\n\r\n", 4);
+    if (end)
+        len = end - data;
+
+    char *line = memchr(data, '\n', len);
+
+    while (line && ++line < data + len) {
+        char *next = memchr(line, '\n', data + len - line);
+        size_t n = (next ? next : data + len) - line;
+
+        if (n > sizeof(name) - 1 &&
+                !strncasecmp(line, name, sizeof(name) - 1)) {
+            char value[BUFFER_SIZE];
+            n -= sizeof(name) - 1;
+            if (n >= sizeof(value))
+                n = sizeof(value) - 1;
+
+            memcpy(value, line + sizeof(name) - 1, n);
+            value[n] = '\0';
+            value[strcspn(value, "\r")] = '\0';
+
+            // strtok is used per offer, so split the offers by hand
+            char *offer = value;
+            while (offer) {
+                char *comma = strchr(offer, ',');
+                if (comma)
+                    *comma++ = '\0';
+
+                int accept = ws_deflate_offer(offer);
+                if (accept)
+                    return accept;
+
+                offer = comma;
+            }
+        }
+
+        line = next;
+    }
 
     return 0;
 }
 
-static void open_cb(struct sev_stream *stream)
+static void ws_inflate_end(struct ws_client *ws)
 {
-    struct mux_client *client = mux_client_open(stream);
+    if (!ws->inflate)
+        return;
 
-    struct ws_parser *parser = malloc(sizeof(struct ws_parser));
-    ws_parser_init(parser);
+    inflateEnd(ws->inflate);
+    free(ws->inflate);
+    ws->inflate = NULL;
+}
 
-    parser->header_cb = header_cb;
-    parser->frame_cb = frame_cb;
+// hand payload bytes to the kernel: whole messages in message mode,
+// newline-delimited lines otherwise; returns -1 if mux closed the client
+static int ws_deliver(struct mux_client *client, char *data, size_t len)
+{
+    struct ws_client *ws = client->data;
 
-    parser->data = client;
-    client->data = parser;
-    stream->data = client;
+    if (!message_mode) {
+        mux_client_data(client, data, len);
+        return ws->error_reason ? -1 : 0;
+    }
+
+    if (ws->message_len + len > MESSAGE_MAX)
+        return -2;
+
+    ws->message = realloc(ws->message, ws->message_len + len);
+    memcpy(ws->message + ws->message_len, data, len);
+    ws->message_len += len;
+
+    return 0;
 }
 
-static void read_cb(struct sev_stream *stream, char *data, size_t len)
+static int ws_message_end(struct mux_client *client)
 {
-    struct mux_client *client = stream->data;
-    struct ws_parser *parser = client->data;
+    struct ws_client *ws = client->data;
+
+    if (!message_mode)
+        return 0;
+
+    int ret = mux_client_message(client, ws->binary, ws->message,
+        ws->message_len);
 
-    if (ws_parse_all(parser, data, len) == -1)
-        sev_close(stream, "websocket parse error");
+    free(ws->message);
+    ws->message = NULL;
+    ws->message_len = 0;
+
+    return ret;
 }
 
-static void close_cb(struct sev_stream *stream, const char *reason)
+static int ws_inflate(struct mux_client *client, char *data, size_t len)
 {
-    struct mux_client *client = stream->data;
-    struct ws_parser *parser = client->data;
+    struct ws_client *ws = client->data;
+    char out[4096];
+
+    // the inflate state only lives for the duration of one message
+    if (!ws->inflate) {
+        ws->inflate = calloc(1, sizeof(z_stream));
+        ws->inflated = 0;
+        ws->inflate_done = 0;
+        if (inflateInit2(ws->inflate, -MAX_WBITS) != Z_OK) {
+            free(ws->inflate);
+            ws->inflate = NULL;
+            return -1;
+        }
+    }
+
+    // the message ended in a final block, and nothing may follow it
+    if (ws->inflate_done)
+        return len ? -1 : 0;
+
+    z_stream *z = ws->inflate;
+    z->next_in = (Bytef *)data;
+    z->avail_in = len;
+
+    do {
+        z->next_out = (Bytef *)out;
+        z->avail_out = sizeof(out);
+
+        int ret = inflate(z, Z_SYNC_FLUSH);
+        if (ret != Z_OK && ret != Z_BUF_ERROR && ret != Z_STREAM_END)
+            return -1;
 
-    free(parser);
-    mux_client_close(client, reason);
+        int done = ret == Z_STREAM_END;
+
+        size_t n = sizeof(out) - z->avail_out;
+        ws->inflated += n;
+        if (ws->inflated > INFLATE_MAX)
+            return -2;
+
+        ret = ws_deliver(client, out, n);
+        if (ret)
+            return ret;
+
+        // rfc 7692 lets a message end in a block with bfinal set
+        if (done) {
+            ws->inflate_done = 1;
+            return z->avail_in ? -1 : 0;
+        }
+    } while (z->avail_in || z->avail_out == 0);
+
+    return 0;
 }
 
-int main(int argc, char *argv[])
+// control frames are answered here and never reach the kernel; returns -1
+// to stop the parser on a close
+static int ws_control(struct mux_client *client, int opcode)
 {
-    mux_init();
+    struct ws_client *ws = client->data;
+    char frame[WS_FRAME_HEADER_SIZE + sizeof(ws->control)];
+    int header_len;
+    size_t code_len;
+
+    switch (opcode) {
+    case WS_PING:
+        header_len = ws_write_frame_header(frame, WS_PONG, ws->control_len);
+        memcpy(frame + header_len, ws->control, ws->control_len);
+        mux_send(client, frame, header_len + ws->control_len);
+        break;
 
-    struct sev_server server;
-    if (sev_listen(&server, PORT)) {
-        perror("sev_server_init");
+    case WS_CLOSE:
+        // echo the status code back, then hang up once parsing is done
+        code_len = ws->control_len < 2 ? 0 : 2;
+        header_len = ws_write_frame_header(frame, WS_CLOSE, code_len);
+        memcpy(frame + header_len, ws->control, code_len);
+        mux_send(client, frame, header_len + code_len);
+        ws->control_len = 0;
+        ws->error_reason = "client close";
         return -1;
     }
 
-    server.open_cb = open_cb;
-    server.read_cb = read_cb;
-    server.close_cb = close_cb;
+    ws->control_len = 0;
+    return 0;
+}
+
+static int ws_frame(struct mux_client *client, struct ws_frame *frame,
+    int last)
+{
+    struct ws_client *ws = client->data;
+
+    if (frame->opcode >= WS_CLOSE) {
+        size_t room = sizeof(ws->control) - ws->control_len;
+        size_t n = frame->chunk_len < room ? frame->chunk_len : room;
+        memcpy(ws->control + ws->control_len, frame->chunk_data, n);
+        ws->control_len += n;
+
+        return last ? ws_control(client, frame->opcode) : 0;
+    }
+
+    // rsv1 on the first frame of a data message marks it as compressed
+    if (frame->opcode != WS_CONT) {
+        ws->binary = frame->opcode == WS_BINARY;
+        ws->compressed = ws->deflate && frame->rsv1;
+    }
 
-    printf("%s started on port %d\n", name, PORT);
+    if (ws->compressed) {
+        int ret = ws_inflate(client, frame->chunk_data, frame->chunk_len);
 
-    sev_loop();
+        if (ret == 0 && last && frame->fin) {
+            char trailer[] = { 0x00, 0x00, (char)0xff, (char)0xff };
+            if (!ws->inflate_done)
+                ret = ws_inflate(client, trailer, sizeof(trailer));
+            ws_inflate_end(ws);
+        }
+
+        if (ret == 0 && last && frame->fin)
+            ret = ws_message_end(client);
+
+        return ret;
+    }
+
+    // an unfragmented message that arrived in one piece is pushed straight
+    // out of the read buffer
+    if (message_mode && ws->message_len == 0 && last && frame->fin &&
+            frame->chunk_len == frame->len) {
+        return mux_client_message(client, ws->binary, frame->chunk_data,
+            frame->chunk_len);
+    }
+
+    int ret = ws_deliver(client, frame->chunk_data, frame->chunk_len);
+    if (ret)
+        return ret;
+
+    if (last && frame->fin)
+        return ws_message_end(client);
 
     return 0;
 }
+
+static int frame_cb(struct ws_frame *frame, void *data)
+{
+    struct mux_client *client = data;
+    struct ws_client *ws = client->data;
+
+    ws->frame_received += frame->chunk_len;
+    int last = ws->frame_received == frame->len;
+    if (last)
+        ws->frame_received = 0;
+
+    int ret = ws_frame(client, frame, last);
+
+    // a close frame, or mux through server_error(), set the reason already
+    if (ret == 0 || ws->error_reason)
+        return ret ? -1 : 0;
+
+    if (ret == -1) {
+        ws->error = 1007;
+        ws->error_reason = "invalid deflate data";
+    }
+    else {
+        ws->error = 1009;
+        ws->error_reason = "message too big";
+    }
+
+    return -1;
+}
+
+static void ws_open(struct mux_client *client)
+{
+    struct ws_client *ws = calloc(1, sizeof(struct ws_client));
+    struct ws_parser *parser = &ws->parser;
+    ws_parser_init(parser);
+
+    parser->header_cb = header_cb;
+    parser->frame_cb = frame_cb;
+
+    parser->data = client;
+    client->data = ws;
+
+    mux_client_state(client, MUX_HANDSHAKE);
+}
+
+static void ws_read(struct mux_client *client, char *data, size_t len)
+{
+    struct ws_client *ws = client->data;
+
+    // libws doesn't parse extensions or the query string, so look for them
+    // in the request
+    if (client->state == MUX_HANDSHAKE) {
+        int deflate = ws_extensions(data, len);
+        if (deflate) {
+            ws->deflate = deflate;
+            client->flags |= WS_FLAG_DEFLATE;
+        }
+
+        ws_resume(ws, data, len);
+    }
+
+    ws->parsing = 1;
+    int ret = ws_parse_all(&ws->parser, data, len);
+    ws->parsing = 0;
+
+    if (ret == -1) {
+        client->resumable = 0;
+
+        if (ws->error)
+            server_error(client, ws->error, ws->error_reason);
+        else if (ws->error_reason)
+            sev_close(client->stream, ws->error_reason);
+        else
+            sev_close(client->stream, "websocket parse error");
+    }
+}
+
+static void ws_close(struct mux_client *client)
+{
+    struct ws_client *ws = client->data;
+
+    ws_inflate_end(ws);
+    free(ws->message);
+    free(ws);
+}
+
+static void ws_init(void)
+{
+    deflateInit2(&deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+        Z_DEFAULT_STRATEGY);
+}
+
+const struct mux_protocol wsmux_protocol = {
+    .name = "wsmux",
+    .port = 8888,
+
+    // lines/sec, bytes/sec, seconds of burst; a whole message can't be
+    // held back like a line, so excess is dropped in either mode
+    .ratelimit = { 10, 8192, 2, RATELIMIT_DROP },
+
+    // rfc 6455 requires text frames to be valid utf-8
+    .utf8_ingress = UTF8_REJECT,
+
+    .resume = 120,
+
+    .init = ws_init,
+    .open = ws_open,
+    .read = ws_read,
+    .close = ws_close,
+    .process_message = process_message,
+
+    .server_message = server_message,
+    .server_broadcast = server_broadcast,
+    .server_close = server_close,
+    .server_ping = server_ping,
+    .server_token = server_token,
+    .server_error = server_error,
+};